@@ -0,0 +1,81 @@
+#ifndef ADLMIDI_CPULEVEL_H
+#define ADLMIDI_CPULEVEL_H
+
+/* Picks the instruction set for the vectorized kernels at runtime, so
+ * a generic build still uses AVX2 or AVX-512 where the cpu has them.
+ * Every kernel is compiled once per level with CPU_TARGET_* wrappers
+ * around a CPU_INLINE body, and calls the one for GetCpuLevel().
+ *
+ * The ADLMIDI_CPU environment variable (generic, avx2 or avx512) or
+ * SetCpuLevel can force a lower level for testing.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+enum CpuLevel
+{
+    CPU_GENERIC, // Whatever the compiler targets, SSE2 on x86-64
+    CPU_AVX2,
+    CPU_AVX512
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define CPU_DISPATCH     1
+# define CPU_INLINE       inline __attribute__((always_inline))
+# define CPU_TARGET_AVX2   __attribute__((target("avx2,fma")))
+# define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2,fma")))
+#else
+# define CPU_DISPATCH     0
+# define CPU_INLINE       inline
+# define CPU_TARGET_AVX2
+# define CPU_TARGET_AVX512
+#endif
+
+static const char* const CpuLevelNames[3] = { "generic", "avx2", "avx512" };
+
+// Best level the cpu and the OS support, from cpuid
+inline CpuLevel DetectCpuLevel()
+{
+#if CPU_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+    && __builtin_cpu_supports("avx512vl"))
+        return CPU_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return CPU_AVX2;
+#endif
+    return CPU_GENERIC;
+}
+
+// Detected level, lowered by ADLMIDI_CPU
+inline CpuLevel StartupCpuLevel()
+{
+    CpuLevel level = DetectCpuLevel();
+    const char* force = std::getenv("ADLMIDI_CPU");
+    for(unsigned a=0; force && a<3; ++a)
+        if(!std::strcmp(force, CpuLevelNames[a]) && a < (unsigned)level)
+            level = (CpuLevel)a;
+    return level;
+}
+
+inline CpuLevel& CurrentCpuLevel()
+{
+    static CpuLevel level = StartupCpuLevel();
+    return level;
+}
+
+inline CpuLevel GetCpuLevel()
+{
+    return CurrentCpuLevel();
+}
+
+// Levels the cpu doesn't support are refused, returns the level in use
+inline CpuLevel SetCpuLevel(CpuLevel level)
+{
+    if(level <= DetectCpuLevel())
+        CurrentCpuLevel() = level;
+    return CurrentCpuLevel();
+}
+
+#endif
@@ -41,7 +41,14 @@ typedef struct vswprintf {} swprintf;
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "dbopl.h"
+#include "cpulevel.h"
 
 
 #ifndef PI
@@ -50,7 +57,7 @@ typedef struct vswprintf {} swprintf;
 
 namespace DBOPL {
 
-#define OPLRATE		((double)(14318180.0 / 288.0))
+#define OPLRATE		((double)DBOPL_NATIVE_CLOCK)
 #define TREMOLO_TABLE 52
 
 //Try to use most precision for frequencies
@@ -90,6 +97,10 @@ namespace DBOPL {
 #define ENV_MAX		( 511 << ENV_EXTRA )
 #define ENV_LIMIT	( ( 12 * 256) >> ( 3 - ENV_EXTRA ) )
 #define ENV_SILENT( _X_ ) ( (_X_) >= ENV_LIMIT )
+//Samples the block templates precompute the envelopes for in one go
+#define ENV_BLOCK	256
+//Samples between envelope steps in the fast quality
+#define ENV_FAST_STEP	4
 
 //Attack/decay/release rate counter shift
 #define RATE_SH		24
@@ -134,16 +145,9 @@ static const Bit8u EnvelopeIncreaseTable[13] = {
 	32, 
 };
 
-#if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
-static Bit16u ExpTable[ 256 ];
-#endif
-
-#if ( DBOPL_WAVE == WAVE_HANDLER )
-//PI table used by WAVEHANDLER
-static Bit16u SinTable[ 512 ];
-#endif
+//ExpTable, SinTable, MulTable and the wave tables, generated by utils/gen_dbopltables.cc
+#include "dbopltables.inc"
 
-#if ( DBOPL_WAVE > WAVE_HANDLER )
 //Layout of the waveform table in 512 entry intervals
 //With overlapping waves we reduce the table to half it's size
 
@@ -153,8 +157,7 @@ static Bit16u SinTable[ 512 ];
 
 //6 is just 0 shifted and masked
 
-static Bit16s WaveTable[ 8 * 512 ];
-//Distance into WaveTable the wave starts
+//Distance into the wavetables the wave starts
 static const Bit16u WaveBaseTable[8] = {
 	0x000, 0x200, 0x200, 0x800,
 	0xa00, 0xc00, 0x100, 0x400,
@@ -171,18 +174,95 @@ static const Bit16u WaveStartTable[8] = {
 	512, 0, 0, 0,
 	0, 512, 512, 256,
 };
-#endif
 
-#if ( DBOPL_WAVE == WAVE_TABLEMUL )
-static Bit16u MulTable[ 384 ];
-#endif
+//Tables the compiler fills in, wrapped so a constexpr function can return them
+template< typename T, int N >
+struct ConstTable {
+	T data[ N ];
+	constexpr const T& operator[]( Bitu i ) const {
+		return data[ i ];
+	}
+};
+
+static constexpr ConstTable< Bit8u, 8 * 16 > MakeKslTable() {
+	ConstTable< Bit8u, 8 * 16 > table = {};
+	for ( int oct = 0; oct < 8; oct++ ) {
+		int base = oct * 8;
+		for ( int i = 0; i < 16; i++ ) {
+			int val = base - KslCreateTable[i];
+			if ( val < 0 )
+				val = 0;
+			//*4 for the final range to match attenuation range
+			table.data[ oct * 16 + i ] = val * 4;
+		}
+	}
+	return table;
+}
+static constexpr ConstTable< Bit8u, 8 * 16 > KslTable = MakeKslTable();
 
-static Bit8u KslTable[ 8 * 16 ];
-static Bit8u TremoloTable[ TREMOLO_TABLE ];
+//Just increase and decrease a triangle wave
+static constexpr ConstTable< Bit8u, TREMOLO_TABLE > MakeTremoloTable() {
+	ConstTable< Bit8u, TREMOLO_TABLE > table = {};
+	for ( int i = 0; i < TREMOLO_TABLE / 2; i++ ) {
+		Bit8u val = i << ENV_EXTRA;
+		table.data[i] = val;
+		table.data[TREMOLO_TABLE - 1 - i] = val;
+	}
+	return table;
+}
+static constexpr ConstTable< Bit8u, TREMOLO_TABLE > TremoloTable = MakeTremoloTable();
 //Start of a channel behind the chip struct start
-static Bit16u ChanOffsetTable[32];
+//Channels that have to be woken up together, 4-op pairs and the percussion channels
+#define CH( _X_ ) ( 1 << (_X_) )
+static const Bit32u ChannelGroupTable[18] = {
+	CH(0) | CH(1), CH(0) | CH(1), CH(2) | CH(3), CH(2) | CH(3), CH(4) | CH(5), CH(4) | CH(5),
+	CH(6) | CH(7) | CH(8), CH(6) | CH(7) | CH(8), CH(6) | CH(7) | CH(8),
+	CH(9) | CH(10), CH(9) | CH(10), CH(11) | CH(12), CH(11) | CH(12), CH(13) | CH(14), CH(13) | CH(14),
+	CH(15), CH(16), CH(17),
+};
+#undef CH
+
+//Four op flags of the channels, bit 7 marks the second channel of a 4-op pair, 0x40 the percussion
+static const Bit8u FourMaskTable[18] = {
+	0x01, 0x81, 0x02, 0x82, 0x04, 0x84, 0x40, 0x40, 0x40,
+	0x08, 0x88, 0x10, 0x90, 0x20, 0xa0, 0x00, 0x00, 0x00,
+};
+
+static constexpr ConstTable< Bit16u, 32 > MakeChanOffsetTable() {
+	ConstTable< Bit16u, 32 > table = {};
+	for ( Bitu i = 0; i < 32; i++ ) {
+		Bitu index = i & 0xf;
+		if ( index >= 9 )
+			continue;
+		//Make sure the four op channels follow eachother
+		if ( index < 6 ) {
+			index = (index % 3) * 2 + ( index / 3 );
+		}
+		//Add back the bits for highest ones
+		if ( i >= 16 )
+			index += 9;
+		table.data[i] = offsetof( Chip, chan ) + index * sizeof( Channel );
+	}
+	return table;
+}
+static constexpr ConstTable< Bit16u, 32 > ChanOffsetTable = MakeChanOffsetTable();
+
 //Start of an operator behind the chip struct start
-static Bit16u OpOffsetTable[64];
+static constexpr ConstTable< Bit16u, 64 > MakeOpOffsetTable() {
+	ConstTable< Bit16u, 64 > table = {};
+	for ( Bitu i = 0; i < 64; i++ ) {
+		if ( i % 8 >= 6 || ( (i / 8) % 4 == 3 ) )
+			continue;
+		Bitu chNum = (i / 8) * 3 + (i % 8) % 3;
+		//Make sure we use 16 and up for the 2nd range to match the chanoffset gap
+		if ( chNum >= 12 )
+			chNum += 16 - 12;
+		Bitu opNum = ( i % 8 ) / 3;
+		table.data[i] = ChanOffsetTable[ chNum ] + offsetof( Channel, op ) + opNum * sizeof( Operator );
+	}
+	return table;
+}
+static constexpr ConstTable< Bit16u, 64 > OpOffsetTable = MakeOpOffsetTable();
 
 //The lower bits are the shift of the operator vibrato value
 //The highest bit is right shifted to generate -1 or 0 for negation
@@ -211,7 +291,6 @@ static void EnvelopeSelect( Bit8u val, Bit8u& index, Bit8u& shift ) {
 	}
 }
 
-#if ( DBOPL_WAVE == WAVE_HANDLER )
 /*
 	Generate the different waveforms out of the sine/exponetial table using handlers
 */
@@ -236,7 +315,7 @@ static Bits DB_FASTCALL WaveForm0( Bitu i, Bitu volume ) {
 }
 static Bits DB_FASTCALL WaveForm1( Bitu i, Bitu volume ) {
 	Bit32u wave = SinTable[i & 511];
-	wave |= ( ( (i ^ 512 ) & 512) - 1) >> ( 32 - 12 );
+	wave |= (Bit32u)( ( (i ^ 512 ) & 512) - 1) >> ( 32 - 12 );
 	return MakeVolume( wave, volume );
 }
 static Bits DB_FASTCALL WaveForm2( Bitu i, Bitu volume ) {
@@ -245,7 +324,7 @@ static Bits DB_FASTCALL WaveForm2( Bitu i, Bitu volume ) {
 }
 static Bits DB_FASTCALL WaveForm3( Bitu i, Bitu volume ) {
 	Bitu wave = SinTable[i & 255];
-	wave |= ( ( (i ^ 256 ) & 256) - 1) >> ( 32 - 12 );
+	wave |= (Bit32u)( ( (i ^ 256 ) & 256) - 1) >> ( 32 - 12 );
 	return MakeVolume( wave, volume );
 }
 static Bits DB_FASTCALL WaveForm4( Bitu i, Bitu volume ) {
@@ -253,14 +332,15 @@ static Bits DB_FASTCALL WaveForm4( Bitu i, Bitu volume ) {
 	i <<= 1;
 	Bits neg = 0 - (( i >> 9) & 1);//Create ~0 or 0
 	Bitu wave = SinTable[i & 511];
-	wave |= ( ( (i ^ 512 ) & 512) - 1) >> ( 32 - 12 );
+	//Silent in the second half of the original period
+	wave |= (Bit32u)( ( (i ^ 1024 ) & 1024) - 1) >> ( 32 - 12 );
 	return (MakeVolume( wave, volume ) ^ neg) - neg;
 }
 static Bits DB_FASTCALL WaveForm5( Bitu i, Bitu volume ) {
 	//Twice as fast
 	i <<= 1;
 	Bitu wave = SinTable[i & 511];
-	wave |= ( ( (i ^ 512 ) & 512) - 1) >> ( 32 - 12 );
+	wave |= (Bit32u)( ( (i ^ 1024 ) & 1024) - 1) >> ( 32 - 12 );
 	return MakeVolume( wave, volume );
 }
 static Bits DB_FASTCALL WaveForm6( Bitu i, Bitu volume ) {
@@ -281,8 +361,6 @@ static const WaveHandler WaveHandlerTable[8] = {
 	WaveForm4, WaveForm5, WaveForm6, WaveForm7
 };
 
-#endif
-
 /*
 	Operator
 */
@@ -292,7 +370,7 @@ inline void Operator::UpdateAttack( const Chip* chip ) {
 	Bit8u rate = reg60 >> 4;
 	if ( rate ) {
 		Bit8u val = (rate << 2) + ksr;
-		attackAdd = chip->attackRates[ val ];
+		attackAdd = chip->rates->attackRates[ val ];
 		rateZero &= ~(1 << ATTACK);
 	} else {
 		attackAdd = 0;
@@ -303,7 +381,7 @@ inline void Operator::UpdateDecay( const Chip* chip ) {
 	Bit8u rate = reg60 & 0xf;
 	if ( rate ) {
 		Bit8u val = (rate << 2) + ksr;
-		decayAdd = chip->linearRates[ val ];
+		decayAdd = chip->rates->linearRates[ val ];
 		rateZero &= ~(1 << DECAY);
 	} else {
 		decayAdd = 0;
@@ -314,7 +392,7 @@ inline void Operator::UpdateRelease( const Chip* chip ) {
 	Bit8u rate = reg80 & 0xf;
 	if ( rate ) {
 		Bit8u val = (rate << 2) + ksr;
-		releaseAdd = chip->linearRates[ val ];
+		releaseAdd = chip->rates->linearRates[ val ];
 		rateZero &= ~(1 << RELEASE);
 		if ( !(reg20 & MASK_SUSTAIN ) ) {
 			rateZero &= ~( 1 << SUSTAIN );
@@ -367,12 +445,16 @@ void Operator::UpdateRates( const Chip* chip ) {
 	if ( !( reg20 & MASK_KSR ) ) {
 		newKsr >>= 2;
 	}
-	if ( ksr == newKsr )
-		return;
 	ksr = newKsr;
 	UpdateAttack( chip );
 	UpdateDecay( chip );
 	UpdateRelease( chip );
+	//With sustain enable the volume doesn't change
+	if ( reg20 & MASK_SUSTAIN || ( !releaseAdd ) ) {
+		rateZero |= ( 1 << SUSTAIN );
+	} else {
+		rateZero &= ~( 1 << SUSTAIN );
+	}
 }
 
 INLINE Bit32s Operator::RateForward( Bit32u add ) {
@@ -383,14 +465,14 @@ INLINE Bit32s Operator::RateForward( Bit32u add ) {
 }
 
 template< Operator::State yes>
-Bits Operator::TemplateVolume(  ) {
+Bits Operator::TemplateVolume( Bitu steps ) {
 	Bit32s vol = volume;
 	Bit32s change;
 	switch ( yes ) {
 	case OFF:
 		return ENV_MAX;
 	case ATTACK:
-		change = RateForward( attackAdd );
+		change = RateForward( attackAdd * steps );
 		if ( !change )
 			return vol;
 		vol += ( (~vol) * change ) >> 3;
@@ -402,7 +484,7 @@ Bits Operator::TemplateVolume(  ) {
 		}
 		break;
 	case DECAY:
-		vol += RateForward( decayAdd );
+		vol += RateForward( decayAdd * steps );
 		if ( GCC_UNLIKELY(vol >= sustainLevel) ) {
 			//Check if we didn't overshoot max attenuation, then just go off
 			if ( GCC_UNLIKELY(vol >= ENV_MAX) ) {
@@ -421,7 +503,7 @@ Bits Operator::TemplateVolume(  ) {
 		}
 		//In sustain phase, but not sustaining, do regular release
 	case RELEASE: 
-		vol += RateForward( releaseAdd );;
+		vol += RateForward( releaseAdd * steps );;
 		if ( GCC_UNLIKELY(vol >= ENV_MAX) ) {
 			volume = ENV_MAX;
 			SetState( OFF );
@@ -433,16 +515,64 @@ Bits Operator::TemplateVolume(  ) {
 	return vol;
 }
 
-static const VolumeHandler VolumeHandlerTable[5] = {
-	&Operator::TemplateVolume< Operator::OFF >,
-	&Operator::TemplateVolume< Operator::RELEASE >,
-	&Operator::TemplateVolume< Operator::SUSTAIN >,
-	&Operator::TemplateVolume< Operator::DECAY >,
-	&Operator::TemplateVolume< Operator::ATTACK >
-};
+INLINE Bitu Operator::ForwardVolume( Bitu steps ) {
+	//Switch on the state so the volume templates get inlined in the sample loops
+	switch ( state ) {
+	case RELEASE:
+		return currentLevel + TemplateVolume< RELEASE >( steps );
+	case SUSTAIN:
+		return currentLevel + TemplateVolume< SUSTAIN >( steps );
+	case DECAY:
+		return currentLevel + TemplateVolume< DECAY >( steps );
+	case ATTACK:
+		return currentLevel + TemplateVolume< ATTACK >( steps );
+	}
+	return currentLevel + TemplateVolume< OFF >( steps );
+}
 
-INLINE Bitu Operator::ForwardVolume() {
-	return currentLevel + (this->*volHandler)();
+INLINE Bitu Operator::ForwardSpan( Bitu samples, Bitu step, Bitu& vol ) {
+	Bit32u add;
+	//Without an overflow of the rate counter the envelope only changes state when it
+	//is already past the limit of the current one
+	bool steady;
+	switch ( state ) {
+	case OFF:
+		vol = currentLevel + ENV_MAX;
+		return samples;
+	case SUSTAIN:
+		if ( reg20 & MASK_SUSTAIN ) {
+			vol = currentLevel + volume;
+			return samples;
+		}
+		//fallthrough
+	case RELEASE:
+		add = releaseAdd;
+		steady = volume < ENV_MAX;
+		break;
+	case DECAY:
+		add = decayAdd;
+		steady = volume < sustainLevel;
+		break;
+	default:
+		add = attackAdd;
+		steady = true;
+		break;
+	}
+	if ( steady ) {
+		//Samples before the rate counter overflows only forward it
+		Bitu run = add ? ( RATE_MASK - rateIndex ) / add : samples;
+		if ( run ) {
+			if ( run > samples )
+				run = samples;
+			rateIndex += run * add;
+			vol = currentLevel + volume;
+			return run;
+		}
+	}
+	if ( step > samples )
+		step = samples;
+	vol = ForwardVolume( step );
+	return step;
 }
 
 
@@ -451,7 +581,7 @@ INLINE Bitu Operator::ForwardWave() {
 	return waveIndex >> WAVE_SH;
 }
 
-void Operator::Write20( const Chip* chip, Bit8u val ) {
+void Operator::Write20( const Chip* /*chip*/, Bit8u val ) {
 	Bit8u change = (reg20 ^ val );
 	if ( !change ) 
 		return;
@@ -459,20 +589,11 @@ void Operator::Write20( const Chip* chip, Bit8u val ) {
 	//Shift the tremolo bit over the entire register, saved a branch, YES!
 	tremoloMask = (Bit8s)(val) >> 7;
 	tremoloMask &= ~(( 1 << ENV_EXTRA ) -1);
-	//Update specific features based on changes
-	if ( change & MASK_KSR ) {
-		UpdateRates( chip );
-	}
-	//With sustain enable the volume doesn't change
-	if ( reg20 & MASK_SUSTAIN || ( !releaseAdd ) ) {
-		rateZero |= ( 1 << SUSTAIN );
-	} else {
-		rateZero &= ~( 1 << SUSTAIN );
-	}
+	//Ksr and sustain both end up in the rates
+	dirty |= DIRTY_RATES;
 	//Frequency multiplier or vibrato changed
 	if ( change & (0xf | MASK_VIBRATO) ) {
-		freqMul = chip->freqMul[ val & 0xf ];
-		UpdateFrequency();
+		dirty |= DIRTY_FREQUENCY;
 	}
 }
 
@@ -480,21 +601,17 @@ void Operator::Write40( const Chip* /*chip*/, Bit8u val ) {
 	if (!(reg40 ^ val )) 
 		return;
 	reg40 = val;
-	UpdateAttenuation( );
+	dirty |= DIRTY_LEVEL;
 }
 
-void Operator::Write60( const Chip* chip, Bit8u val ) {
-	Bit8u change = reg60 ^ val;
+void Operator::Write60( const Chip* /*chip*/, Bit8u val ) {
+	if ( !(reg60 ^ val ) )
+		return;
 	reg60 = val;
-	if ( change & 0x0f ) {
-		UpdateDecay( chip );
-	}
-	if ( change & 0xf0 ) {
-		UpdateAttack( chip );
-	}
+	dirty |= DIRTY_RATES;
 }
 
-void Operator::Write80( const Chip* chip, Bit8u val ) {
+void Operator::Write80( const Chip* /*chip*/, Bit8u val ) {
 	Bit8u change = (reg80 ^ val );
 	if ( !change ) 
 		return;
@@ -504,7 +621,7 @@ void Operator::Write80( const Chip* chip, Bit8u val ) {
 	sustain |= ( sustain + 1) & 0x10;
 	sustainLevel = sustain << ( ENV_BITS - 5 );
 	if ( change & 0x0f ) {
-		UpdateRelease( chip );
+		dirty |= DIRTY_RATES;
 	}
 }
 
@@ -514,18 +631,51 @@ void Operator::WriteE0( const Chip* chip, Bit8u val ) {
 	//in opl3 mode you can always selet 7 waveforms regardless of waveformselect
 	Bit8u waveForm = val & ( ( 0x3 & chip->waveFormMask ) | (0x7 & chip->opl3Active ) );
 	regE0 = val;
-#if ( DBOPL_WAVE == WAVE_HANDLER )
-	waveHandler = WaveHandlerTable[ waveForm ];
-#else
-	waveBase = WaveTable + WaveBaseTable[ waveForm ];
-	waveStart = WaveStartTable[ waveForm ] << WAVE_SH;
-	waveMask = WaveMaskTable[ waveForm ];
-#endif
+	this->waveForm = waveForm;
+	dirty |= DIRTY_WAVE;
+	//A key on picks this up right away, so it can't wait for Update.
+	//The handlers start every wave at the beginning of the counter
+	if ( chip->waveMode == WAVE_HANDLER )
+		waveStart = 0;
+	else
+		waveStart = WaveStartTable[ waveForm ] << WAVE_SH;
+}
+
+void Operator::UpdateWaveBase( const Chip* chip ) {
+	switch ( chip->waveMode ) {
+	case WAVE_TABLELOG:
+		waveBase = WaveTableLog + WaveBaseTable[ waveForm ];
+		break;
+	case WAVE_TABLEFAST:
+		//A quarter of the entries, so are the offsets
+		waveBase = WaveTableFast + ( WaveBaseTable[ waveForm ] >> 2 );
+		break;
+	default:
+		waveBase = WaveTableMul + WaveBaseTable[ waveForm ];
+		break;
+	}
+}
+
+void Operator::Update( const Chip* chip ) {
+	if ( dirty & DIRTY_FREQUENCY ) {
+		freqMul = chip->rates->freqMul[ reg20 & 0xf ];
+		UpdateFrequency();
+	}
+	if ( dirty & DIRTY_LEVEL ) {
+		UpdateAttenuation();
+	}
+	if ( dirty & DIRTY_RATES ) {
+		UpdateRates( chip );
+	}
+	if ( dirty & DIRTY_WAVE ) {
+		UpdateWaveBase( chip );
+		waveMask = WaveMaskTable[ waveForm ];
+	}
+	dirty = 0;
 }
 
 INLINE void Operator::SetState( Bit8u s ) {
 	state = s;
-	volHandler = VolumeHandlerTable[ s ];
 }
 
 INLINE bool Operator::Silent() const {
@@ -536,7 +686,20 @@ INLINE bool Operator::Silent() const {
 	return true;
 }
 
+template< bool lfo >
 INLINE void Operator::Prepare( const Chip* chip )  {
+	//Nothing changed since the last time
+	if ( chip->quality == DBOPL_QUALITY_FAST ) {
+		if ( preparedStamp == chip->prepareStamp )
+			return;
+		preparedStamp = chip->prepareStamp;
+	}
+	//Without tremolo and vibrato the masks below would clear the lfo values anyway
+	if ( !lfo ) {
+		currentLevel = totalLevel;
+		waveCurrent = waveAdd;
+		return;
+	}
 	currentLevel = totalLevel + (chip->tremoloValue & tremoloMask);
 	waveCurrent = waveAdd;
 	if ( vibStrength >> chip->vibratoShift ) {
@@ -552,11 +715,7 @@ INLINE void Operator::Prepare( const Chip* chip )  {
 void Operator::KeyOn( Bit8u mask ) {
 	if ( !keyOn ) {
 		//Restart the frequency generator
-#if ( DBOPL_WAVE > WAVE_HANDLER )
 		waveIndex = waveStart;
-#else
-		waveIndex = 0;
-#endif
 		rateIndex = 0;
 		SetState( ATTACK );
 	}
@@ -572,25 +731,27 @@ void Operator::KeyOff( Bit8u mask ) {
 	}
 }
 
+template< int wave >
 INLINE Bits Operator::GetWave( Bitu index, Bitu vol ) {
-#if ( DBOPL_WAVE == WAVE_HANDLER )
-	return waveHandler( index, vol << ( 3 - ENV_EXTRA ) );
-#elif ( DBOPL_WAVE == WAVE_TABLEMUL )
-	return (waveBase[ index & waveMask ] * MulTable[ vol >> ENV_EXTRA ]) >> MUL_SH;
-#elif ( DBOPL_WAVE == WAVE_TABLELOG )
-	Bit32s wave = waveBase[ index & waveMask ];
-	Bit32u total = ( wave & 0x7fff ) + vol << ( 3 - ENV_EXTRA );
-	Bit32s sig = ExpTable[ total & 0xff ];
-	Bit32u exp = total >> 8;
-	Bit32s neg = wave >> 16;
-	return ((sig ^ neg) - neg) >> exp;
-#else
-#error "No valid wave routine"
-#endif
+	if ( wave == WAVE_HANDLER ) {
+		return WaveHandlerTable[ waveForm ]( index, vol << ( 3 - ENV_EXTRA ) );
+	} else if ( wave == WAVE_TABLELOG ) {
+		Bit32s w = waveBase[ index & waveMask ];
+		Bit32u total = ( w & 0x7fff ) + ( vol << ( 3 - ENV_EXTRA ) );
+		Bit32s sig = ExpTable[ total & 0xff ];
+		Bit32u exp = total >> 8;
+		Bit32s neg = w >> 16;
+		return ((sig ^ neg) - neg) >> exp;
+	} else if ( wave == WAVE_TABLEFAST ) {
+		return (waveBase[ ( index & waveMask ) >> 2 ] * MulTable[ vol >> ENV_EXTRA ]) >> MUL_SH;
+	} else {
+		return (waveBase[ index & waveMask ] * MulTable[ vol >> ENV_EXTRA ]) >> MUL_SH;
+	}
 }
 
-Bits INLINE Operator::GetSample( Bits modulation ) {
-	Bitu vol = ForwardVolume();
+//Inlined into the block loops with the other wave modes around this ends up slower
+template< int wave >
+NOINLINE Bits Operator::GetSample( Bits modulation, Bitu vol ) {
 	if ( ENV_SILENT( vol ) ) {
 		//Simply forward the wave
 		waveIndex += waveCurrent;
@@ -598,7 +759,27 @@ Bits INLINE Operator::GetSample( Bits modulation ) {
 	} else {
 		Bitu index = ForwardWave();
 		index += modulation;
-		return GetWave( index, vol );
+		return GetWave< wave >( index, vol );
+	}
+}
+
+void Operator::VolumeBlock( Bitu samples, Bitu step, Bit16u* vol ) {
+	for ( Bitu i = 0; i < samples; ) {
+		Bitu value;
+		Bitu run = ForwardSpan( samples - i, step, value );
+		for ( ; run > 0; run--, i++ )
+			vol[ i ] = value;
+	}
+}
+
+void Operator::EnvelopeBlock( Bitu samples, Bitu step, Bit16u* mul, Bitu stride ) {
+	for ( Bitu i = 0; i < samples; ) {
+		Bitu vol;
+		Bitu run = ForwardSpan( samples - i, step, vol );
+		//A zero multiplier gives the same 0 as the silent path in GetSample
+		Bit16u value = ENV_SILENT( vol ) ? 0 : MulTable[ vol >> ENV_EXTRA ];
+		for ( ; run > 0; run--, i++ )
+			mul[ i * stride ] = value;
 	}
 }
 
@@ -619,6 +800,8 @@ Operator::Operator() {
 	rateZero = (1 << OFF);
 	sustainLevel = ENV_MAX;
 	currentLevel = ENV_MAX;
+	preparedStamp = 0;
+	dirty = 0;
 	totalLevel = ENV_MAX;
 	volume = ENV_MAX;
 	releaseAdd = 0;
@@ -637,25 +820,24 @@ Channel::Channel() {
 	maskRight = -1;
 	feedback = 31;
 	fourMask = 0;
-	synthHandler = &Channel::BlockTemplate< sm2FM >;
+	synthMode = sm2FM;
 };
 
-void Channel::SetChanData( const Chip* chip, Bit32u data ) {
+void Channel::SetChanData( const Chip* /*chip*/, Bit32u data ) {
 	Bit32u change = chanData ^ data;
 	chanData = data;
 	Op( 0 )->chanData = data;
 	Op( 1 )->chanData = data;
 	//Since a frequency update triggered this, always update frequency
-	Op( 0 )->UpdateFrequency();
-	Op( 1 )->UpdateFrequency();
+	Bit8u dirty = Operator::DIRTY_FREQUENCY;
 	if ( change & ( 0xff << SHIFT_KSLBASE ) ) {
-		Op( 0 )->UpdateAttenuation();
-		Op( 1 )->UpdateAttenuation();
+		dirty |= Operator::DIRTY_LEVEL;
 	}
 	if ( change & ( 0xff << SHIFT_KEYCODE ) ) {
-		Op( 0 )->UpdateRates( chip );
-		Op( 1 )->UpdateRates( chip );
+		dirty |= Operator::DIRTY_RATES;
 	}
+	Op( 0 )->dirty |= dirty;
+	Op( 1 )->dirty |= dirty;
 }
 
 void Channel::UpdateFrequency( const Chip* chip, Bit8u fourOp ) {
@@ -748,16 +930,16 @@ void Channel::WriteC0( const Chip* chip, Bit8u val ) {
 			Bit8u synth = ( (chan0->regC0 & 1) << 0 )| (( chan1->regC0 & 1) << 1 );
 			switch ( synth ) {
 			case 0:
-				chan0->synthHandler = &Channel::BlockTemplate< sm3FMFM >;
+				chan0->synthMode = sm3FMFM;
 				break;
 			case 1:
-				chan0->synthHandler = &Channel::BlockTemplate< sm3AMFM >;
+				chan0->synthMode = sm3AMFM;
 				break;
 			case 2:
-				chan0->synthHandler = &Channel::BlockTemplate< sm3FMAM >;
+				chan0->synthMode = sm3FMAM;
 				break;
 			case 3:
-				chan0->synthHandler = &Channel::BlockTemplate< sm3AMAM >;
+				chan0->synthMode = sm3AMAM;
 				break;
 			}
 		//Disable updating percussion channels
@@ -765,9 +947,9 @@ void Channel::WriteC0( const Chip* chip, Bit8u val ) {
 
 		//Regular dual op, am or fm
 		} else if ( val & 1 ) {
-			synthHandler = &Channel::BlockTemplate< sm3AM >;
+			synthMode = sm3AM;
 		} else {
-			synthHandler = &Channel::BlockTemplate< sm3FM >;
+			synthMode = sm3FM;
 		}
 		maskLeft = ( val & 0x10 ) ? -1 : 0;
 		maskRight = ( val & 0x20 ) ? -1 : 0;
@@ -778,9 +960,9 @@ void Channel::WriteC0( const Chip* chip, Bit8u val ) {
 
 		//Regular dual op, am or fm
 		} else if ( val & 1 ) {
-			synthHandler = &Channel::BlockTemplate< sm2AM >;
+			synthMode = sm2AM;
 		} else {
-			synthHandler = &Channel::BlockTemplate< sm2FM >;
+			synthMode = sm2FM;
 		}
 	}
 }
@@ -791,14 +973,14 @@ void Channel::ResetC0( const Chip* chip ) {
 	WriteC0( chip, val );
 };
 
-template< bool opl3Mode>
-INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
+template< bool opl3Mode, int wave >
+INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output, const Bit16u* vol ) {
 	Channel* chan = this;
 
 	//BassDrum
 	Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
 	old[0] = old[1];
-	old[1] = Op(0)->GetSample( mod ); 
+	old[1] = Op(0)->GetSample< wave >( mod, vol[ 0 ] ); 
 
 	//When bassdrum is in AM mode first operator is ignoed
 	if ( chan->regC0 & 1 ) {
@@ -806,7 +988,7 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 	} else {
 		mod = old[0];
 	}
-	Bit32s sample = Op(1)->GetSample( mod ); 
+	Bit32s sample = Op(1)->GetSample< wave >( mod, vol[ ENV_BLOCK ] ); 
 
 
 	//Precalculate stuff used by other outputs
@@ -816,25 +998,25 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 	Bit32u phaseBit = (((c2 & 0x88) ^ ((c2<<5) & 0x80)) | ((c5 ^ (c5<<2)) & 0x20)) ? 0x02 : 0x00;
 
 	//Hi-Hat
-	Bit32u hhVol = Op(2)->ForwardVolume();
+	Bit32u hhVol = vol[ 2 * ENV_BLOCK ];
 	if ( !ENV_SILENT( hhVol ) ) {
 		Bit32u hhIndex = (phaseBit<<8) | (0x34 << ( phaseBit ^ (noiseBit << 1 )));
-		sample += Op(2)->GetWave( hhIndex, hhVol );
+		sample += Op(2)->GetWave< wave >( hhIndex, hhVol );
 	}
 	//Snare Drum
-	Bit32u sdVol = Op(3)->ForwardVolume();
+	Bit32u sdVol = vol[ 3 * ENV_BLOCK ];
 	if ( !ENV_SILENT( sdVol ) ) {
 		Bit32u sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
-		sample += Op(3)->GetWave( sdIndex, sdVol );
+		sample += Op(3)->GetWave< wave >( sdIndex, sdVol );
 	}
 	//Tom-tom
-	sample += Op(4)->GetSample( 0 );
+	sample += Op(4)->GetSample< wave >( 0, vol[ 4 * ENV_BLOCK ] );
 
 	//Top-Cymbal
-	Bit32u tcVol = Op(5)->ForwardVolume();
+	Bit32u tcVol = vol[ 5 * ENV_BLOCK ];
 	if ( !ENV_SILENT( tcVol ) ) {
 		Bit32u tcIndex = (1 + phaseBit) << 8;
-		sample += Op(5)->GetWave( tcIndex, tcVol );
+		sample += Op(5)->GetWave< wave >( tcIndex, tcVol );
 	}
 	sample <<= 1;
 	if ( opl3Mode ) {
@@ -845,116 +1027,130 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 	}
 }
 
-template<SynthMode mode>
+INLINE Channel* Channel::Sleep( Chip* chip, Bitu count ) {
+	old[0] = old[1] = 0;
+	//Stays silent till a register write touches the channel again
+	chip->activeMask &= ~( ( ( 1 << count ) - 1 ) << ( this - chip->chan ) );
+	return this + count;
+}
+
+template<SynthMode mode, bool lfo, int wave>
 Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
 	switch( mode ) {
 	case sm2AM:
 	case sm3AM:
 		if ( Op(0)->Silent() && Op(1)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 1);
+			return Sleep( chip, 1 );
 		}
 		break;
 	case sm2FM:
 	case sm3FM:
 		if ( Op(1)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 1);
+			return Sleep( chip, 1 );
 		}
 		break;
 	case sm3FMFM:
 		if ( Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
+			return Sleep( chip, 2 );
 		}
 		break;
 	case sm3AMFM:
 		if ( Op(0)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
+			return Sleep( chip, 2 );
 		}
 		break;
 	case sm3FMAM:
 		if ( Op(1)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
+			return Sleep( chip, 2 );
 		}
 		break;
 	case sm3AMAM:
 		if ( Op(0)->Silent() && Op(2)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
+			return Sleep( chip, 2 );
 		}
 		break;
 	default:
 		break;
 	}
 	//Init the operators with the the current vibrato and tremolo values
-	Op( 0 )->Prepare( chip );
-	Op( 1 )->Prepare( chip );
+	Op( 0 )->Prepare< lfo >( chip );
+	Op( 1 )->Prepare< lfo >( chip );
 	if ( mode > sm4Start ) {
-		Op( 2 )->Prepare( chip );
-		Op( 3 )->Prepare( chip );
+		Op( 2 )->Prepare< lfo >( chip );
+		Op( 3 )->Prepare< lfo >( chip );
 	}
 	if ( mode > sm6Start ) {
-		Op( 4 )->Prepare( chip );
-		Op( 5 )->Prepare( chip );
-	}
-	for ( Bitu i = 0; i < samples; i++ ) {
-		//Early out for percussion handlers
-		if ( mode == sm2Percussion ) {
-			GeneratePercussion<false>( chip, output + i );
-			continue;	//Prevent some unitialized value bitching
-		} else if ( mode == sm3Percussion ) {
-			GeneratePercussion<true>( chip, output + i * 2 );
-			continue;	//Prevent some unitialized value bitching
+		Op( 4 )->Prepare< lfo >( chip );
+		Op( 5 )->Prepare< lfo >( chip );
+	}
+	//Operators used by this mode
+	const Bitu ops = mode > sm6Start ? 6 : ( mode > sm4Start ? 4 : 2 );
+	Bit16u vol[ 6 ][ ENV_BLOCK ];
+	for ( Bitu start = 0; start < samples; start += ENV_BLOCK ) {
+		Bitu todo = samples - start;
+		if ( todo > ENV_BLOCK )
+			todo = ENV_BLOCK;
+		//The envelopes don't depend on the wave output so run them ahead in spans
+		for ( Bitu o = 0; o < ops; o++ ) {
+			Op( o )->VolumeBlock( todo, chip->envelopeStep, vol[ o ] );
 		}
+		for ( Bitu j = 0; j < todo; j++ ) {
+			Bitu i = start + j;
+			//Early out for percussion handlers
+			if ( mode == sm2Percussion ) {
+				GeneratePercussion<false, wave>( chip, output + i, &vol[ 0 ][ j ] );
+				continue;	//Prevent some unitialized value bitching
+			} else if ( mode == sm3Percussion ) {
+				GeneratePercussion<true, wave>( chip, output + i * 2, &vol[ 0 ][ j ] );
+				continue;	//Prevent some unitialized value bitching
+			}
 
-		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
-		Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
-		old[0] = old[1];
-		old[1] = Op(0)->GetSample( mod );
-		Bit32s sample;
-		Bit32s out0 = old[0];
-		if ( mode == sm2AM || mode == sm3AM ) {
-			sample = out0 + Op(1)->GetSample( 0 );
-		} else if ( mode == sm2FM || mode == sm3FM ) {
-			sample = Op(1)->GetSample( out0 );
-		} else if ( mode == sm3FMFM ) {
-			Bits next = Op(1)->GetSample( out0 ); 
-			next = Op(2)->GetSample( next );
-			sample = Op(3)->GetSample( next );
-		} else if ( mode == sm3AMFM ) {
-			sample = out0;
-			Bits next = Op(1)->GetSample( 0 ); 
-			next = Op(2)->GetSample( next );
-			sample += Op(3)->GetSample( next );
-		} else if ( mode == sm3FMAM ) {
-			sample = Op(1)->GetSample( out0 );
-			Bits next = Op(2)->GetSample( 0 );
-			sample += Op(3)->GetSample( next );
-		} else if ( mode == sm3AMAM ) {
-			sample = out0;
-			Bits next = Op(1)->GetSample( 0 ); 
-			sample += Op(2)->GetSample( next );
-			sample += Op(3)->GetSample( 0 );
-		}
-		switch( mode ) {
-		case sm2AM:
-		case sm2FM:
-			output[ i ] += sample;
-			break;
-		case sm3AM:
-		case sm3FM:
-		case sm3FMFM:
-		case sm3AMFM:
-		case sm3FMAM:
-		case sm3AMAM:
-			output[ i * 2 + 0 ] += sample & maskLeft;
-			output[ i * 2 + 1 ] += sample & maskRight;
-			break;
-		default:
-			break;
+			//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
+			Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
+			old[0] = old[1];
+			old[1] = Op(0)->GetSample< wave >( mod, vol[ 0 ][ j ] );
+			Bit32s sample;
+			Bit32s out0 = old[0];
+			if ( mode == sm2AM || mode == sm3AM ) {
+				sample = out0 + Op(1)->GetSample< wave >( 0, vol[ 1 ][ j ] );
+			} else if ( mode == sm2FM || mode == sm3FM ) {
+				sample = Op(1)->GetSample< wave >( out0, vol[ 1 ][ j ] );
+			} else if ( mode == sm3FMFM ) {
+				Bits next = Op(1)->GetSample< wave >( out0, vol[ 1 ][ j ] ); 
+				next = Op(2)->GetSample< wave >( next, vol[ 2 ][ j ] );
+				sample = Op(3)->GetSample< wave >( next, vol[ 3 ][ j ] );
+			} else if ( mode == sm3AMFM ) {
+				sample = out0;
+				Bits next = Op(1)->GetSample< wave >( 0, vol[ 1 ][ j ] ); 
+				next = Op(2)->GetSample< wave >( next, vol[ 2 ][ j ] );
+				sample += Op(3)->GetSample< wave >( next, vol[ 3 ][ j ] );
+			} else if ( mode == sm3FMAM ) {
+				sample = Op(1)->GetSample< wave >( out0, vol[ 1 ][ j ] );
+				Bits next = Op(2)->GetSample< wave >( 0, vol[ 2 ][ j ] );
+				sample += Op(3)->GetSample< wave >( next, vol[ 3 ][ j ] );
+			} else if ( mode == sm3AMAM ) {
+				sample = out0;
+				Bits next = Op(1)->GetSample< wave >( 0, vol[ 1 ][ j ] ); 
+				sample += Op(2)->GetSample< wave >( next, vol[ 2 ][ j ] );
+				sample += Op(3)->GetSample< wave >( 0, vol[ 3 ][ j ] );
+			}
+			switch( mode ) {
+			case sm2AM:
+			case sm2FM:
+				output[ i ] += sample;
+				break;
+			case sm3AM:
+			case sm3FM:
+			case sm3FMFM:
+			case sm3AMFM:
+			case sm3FMAM:
+			case sm3AMAM:
+				output[ i * 2 + 0 ] += sample & maskLeft;
+				output[ i * 2 + 1 ] += sample & maskRight;
+				break;
+			default:
+				break;
+			}
 		}
 	}
 	switch( mode ) {
@@ -975,6 +1171,50 @@ Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
 	return 0;
 }
 
+INLINE bool Channel::LfoEnabled( Bitu ops ) {
+	Bit8u reg20 = 0;
+	for ( Bitu i = 0; i < ops; i++ )
+		reg20 |= Op( i )->reg20;
+	return reg20 & ( Operator::MASK_TREMOLO | Operator::MASK_VIBRATO );
+}
+
+template<SynthMode mode, bool lfo>
+INLINE Channel* Channel::BlockWave( Chip* chip, Bit32u samples, Bit32s* output ) {
+	switch ( chip->waveMode ) {
+	case WAVE_HANDLER:
+		return BlockTemplate< mode, lfo, WAVE_HANDLER >( chip, samples, output );
+	case WAVE_TABLELOG:
+		return BlockTemplate< mode, lfo, WAVE_TABLELOG >( chip, samples, output );
+	case WAVE_TABLEFAST:
+		return BlockTemplate< mode, lfo, WAVE_TABLEFAST >( chip, samples, output );
+	}
+	return BlockTemplate< mode, lfo, WAVE_TABLEMUL >( chip, samples, output );
+}
+
+#define BLOCK( _MODE_, _OPS_ )												\
+	case _MODE_:															\
+		if ( LfoEnabled( _OPS_ ) )											\
+			return BlockWave< _MODE_, true >( chip, samples, output );		\
+		return BlockWave< _MODE_, false >( chip, samples, output );
+
+Channel* Channel::Block( Chip* chip, Bit32u samples, Bit32s* output ) {
+	switch ( synthMode ) {
+	BLOCK( sm2AM, 2 )
+	BLOCK( sm2FM, 2 )
+	BLOCK( sm3AM, 2 )
+	BLOCK( sm3FM, 2 )
+	BLOCK( sm3FMFM, 4 )
+	BLOCK( sm3AMFM, 4 )
+	BLOCK( sm3FMAM, 4 )
+	BLOCK( sm3AMAM, 4 )
+	BLOCK( sm2Percussion, 6 )
+	BLOCK( sm3Percussion, 6 )
+	}
+	return this + 1;
+}
+
+#undef BLOCK
+
 /*
 	Chip
 */
@@ -985,12 +1225,24 @@ Chip::Chip() {
 	regBD = 0;
 	reg104 = 0;
 	opl3Active = 0;
+	groupChannels = 1;
+	waveMode = DBOPL_WAVE;
+	quality = DBOPL_QUALITY_EXACT;
+	envelopeStep = 1;
+	dirtyMask = 0;
+	prepareStamp = 1;
+	activeMask = ACTIVE_ALL;
 }
 
 INLINE Bit32u Chip::ForwardNoise() {
 	noiseCounter += noiseAdd;
 	Bitu count = noiseCounter >> LFO_SH;
-	noiseCounter &= WAVE_MASK;
+	//The fast quality steps the noise once per cycle of the real chip, the
+	//wider mask here keeps hundreds of steps of catching up for every sample
+	if ( quality == DBOPL_QUALITY_FAST )
+		noiseCounter &= ( 1 << LFO_SH ) - 1;
+	else
+		noiseCounter &= WAVE_MASK;
 	for ( ; count > 0; --count ) {
 		//Noise calculation from mame
 		noiseValue ^= ( 0x800302 ) & ( 0 - (noiseValue & 1 ) );
@@ -1000,10 +1252,15 @@ INLINE Bit32u Chip::ForwardNoise() {
 }
 
 INLINE Bit32u Chip::ForwardLFO( Bit32u samples ) {
+	Bit8s oldSign = vibratoSign;
+	Bit8u oldShift = vibratoShift;
+	Bit8u oldTremolo = tremoloValue;
 	//Current vibrato value, runs 4x slower than tremolo
 	vibratoSign = ( VibratoTable[ vibratoIndex >> 2] ) >> 7;
 	vibratoShift = ( VibratoTable[ vibratoIndex >> 2] & 7) + vibratoStrength; 
 	tremoloValue = TremoloTable[ tremoloIndex ] >> tremoloStrength;
+	if ( vibratoSign != oldSign || vibratoShift != oldShift || tremoloValue != oldTremolo )
+		prepareStamp++;
 
 	//Check hom many samples there can be done before the value changes
 	Bit32u todo = LFO_MAX - lfoCounter;
@@ -1031,6 +1288,7 @@ void Chip::WriteBD( Bit8u val ) {
 	if ( !change )
 		return;
 	regBD = val;
+	activeMask |= ChannelGroupTable[ 6 ];
 	//TODO could do this with shift and xor?
 	vibratoStrength = (val & 0x40) ? 0x00 : 0x01;
 	tremoloStrength = (val & 0x80) ? 0x00 : 0x02;
@@ -1038,9 +1296,9 @@ void Chip::WriteBD( Bit8u val ) {
 		//Drum was just enabled, make sure channel 6 has the right synth
 		if ( change & 0x20 ) {
 			if ( opl3Active ) {
-				chan[6].synthHandler = &Channel::BlockTemplate< sm3Percussion >; 
+				chan[6].synthMode = sm3Percussion;
 			} else {
-				chan[6].synthHandler = &Channel::BlockTemplate< sm2Percussion >; 
+				chan[6].synthMode = sm2Percussion;
 			}
 		}
 		//Bass Drum
@@ -1094,6 +1352,7 @@ void Chip::WriteBD( Bit8u val ) {
 	if ( OpOffsetTable[ index ] ) {													\
 		Operator* regOp = (Operator*)( ((char *)this ) + OpOffsetTable[ index ] );	\
 		regOp->_FUNC_( this, val );													\
+		WakeChannel( ( (char *)regOp - (char *)chan ) / sizeof( Channel ) );		\
 	}
 
 #define REGCHAN( _FUNC_ )																\
@@ -1101,12 +1360,34 @@ void Chip::WriteBD( Bit8u val ) {
 	if ( ChanOffsetTable[ index ] ) {													\
 		Channel* regChan = (Channel*)( ((char *)this ) + ChanOffsetTable[ index ] );	\
 		regChan->_FUNC_( this, val );													\
+		WakeChannel( regChan - chan );													\
+	}
+
+INLINE void Chip::WakeChannel( Bitu index ) {
+	activeMask |= ChannelGroupTable[ index ];
+	//Channel writes can touch the operators of the whole 4 op pair
+	dirtyMask |= ChannelGroupTable[ index ];
+}
+
+void Chip::UpdateOperators() {
+	for ( Bitu i = 0; i < 18; i++ ) {
+		if ( !( dirtyMask & ( 1 << i ) ) )
+			continue;
+		if ( chan[i].op[0].dirty )
+			chan[i].op[0].Update( this );
+		if ( chan[i].op[1].dirty )
+			chan[i].op[1].Update( this );
 	}
+	dirtyMask = 0;
+}
 
 void Chip::WriteReg( Bit32u reg, Bit8u val ) {
 	Bitu index;
+	prepareStamp++;
 	switch ( (reg & 0xf0) >> 4 ) {
 	case 0x00 >> 4:
+		//Global settings can change the synth modes of any channel
+		activeMask = ACTIVE_ALL;
 		if ( reg == 0x01 ) {
 			waveFormMask = ( val & 0x20 ) ? 0x7 : 0x0; 
 		} else if ( reg == 0x104 ) {
@@ -1180,49 +1461,443 @@ Bit32u Chip::WriteAddr( Bit32u port, Bit8u val ) {
 	return 0;
 }
 
+template< bool opl3Mode, int wave >
+CPU_INLINE void Chip::GenerateGroup( Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output ) {
+	//Lane state for up to GROUP_LANES channels, unused lanes stay silent with a zero volume
+	Bit16u mul[ 2 ][ GROUP_SAMPLES ][ GROUP_LANES ];
+	Bit32u base[ 2 ][ GROUP_LANES ];
+	Bit32u mask[ 2 ][ GROUP_LANES ];
+	Bit32u index[ 2 ][ GROUP_LANES ];
+	Bit32u add[ 2 ][ GROUP_LANES ];
+	Bit32s old0[ GROUP_LANES ], old1[ GROUP_LANES ];
+	Bit32s am[ GROUP_LANES ];
+	Bit32s left[ GROUP_LANES ], right[ GROUP_LANES ];
+	Bit32u feedback[ GROUP_LANES ];
+	//The coarse table of the fast quality is indexed with the top bits only
+	const Bit16s* table16 = wave == WAVE_TABLEFAST ? WaveTableFast : WaveTableMul;
+	const Bit32s* table32 = wave == WAVE_TABLEFAST ? WaveTableFast32 : WaveTable32;
+	const Bitu coarse = wave == WAVE_TABLEFAST ? 2 : 0;
+	for ( ; count > 0; group += GROUP_LANES, amMask += GROUP_LANES ) {
+		Bitu lanes = count > GROUP_LANES ? GROUP_LANES : count;
+		count -= lanes;
+		memset( mul, 0, sizeof( mul ) );
+		for ( Bitu l = 0; l < GROUP_LANES; l++ ) {
+			if ( l >= lanes ) {
+				for ( Bitu o = 0; o < 2; o++ )
+					base[ o ][ l ] = mask[ o ][ l ] = index[ o ][ l ] = add[ o ][ l ] = 0;
+				old0[ l ] = old1[ l ] = am[ l ] = left[ l ] = right[ l ] = 0;
+				feedback[ l ] = 31;
+				continue;
+			}
+			const Channel* ch = group[ l ];
+			for ( Bitu o = 0; o < 2; o++ ) {
+				//Offsets into the shared wavetable so the lookups become gathers
+				base[ o ][ l ] = (Bit32u)( ch->op[ o ].waveBase - table16 );
+				mask[ o ][ l ] = ch->op[ o ].waveMask;
+				index[ o ][ l ] = ch->op[ o ].waveIndex;
+				add[ o ][ l ] = ch->op[ o ].waveCurrent;
+			}
+			old0[ l ] = ch->old[ 0 ];
+			old1[ l ] = ch->old[ 1 ];
+			am[ l ] = amMask[ l ];
+			left[ l ] = opl3Mode ? ch->maskLeft : -1;
+			right[ l ] = opl3Mode ? ch->maskRight : -1;
+			feedback[ l ] = ch->feedback;
+		}
+		Bit32s* out = output;
+		for ( Bitu total = samples; total > 0; ) {
+			Bitu todo = total > GROUP_SAMPLES ? GROUP_SAMPLES : total;
+			//Envelopes don't depend on the wave output so run them ahead for the whole pass
+			for ( Bitu l = 0; l < lanes; l++ ) {
+				for ( Bitu o = 0; o < 2; o++ ) {
+					group[ l ]->op[ o ].EnvelopeBlock( todo, envelopeStep, &mul[ o ][ 0 ][ l ], GROUP_LANES );
+				}
+			}
+			for ( Bitu i = 0; i < todo; i++ ) {
+				Bit32s sumLeft = 0;
+				Bit32s sumRight = 0;
+				#pragma omp simd reduction(+:sumLeft,sumRight)
+				for ( Bitu l = 0; l < GROUP_LANES; l++ ) {
+					Bit32s mod = (Bit32u)( old0[ l ] + old1[ l ] ) >> feedback[ l ];
+					Bit32s out0 = old1[ l ];
+					old0[ l ] = out0;
+					index[ 0 ][ l ] += add[ 0 ][ l ];
+					Bit32u pos = ( ( index[ 0 ][ l ] >> WAVE_SH ) + mod ) & mask[ 0 ][ l ];
+					old1[ l ] = ( table32[ (Bit32s)( base[ 0 ][ l ] + ( pos >> coarse ) ) ] * mul[ 0 ][ i ][ l ] ) >> MUL_SH;
+					//AM lanes add the first operator instead of modulating with it
+					index[ 1 ][ l ] += add[ 1 ][ l ];
+					pos = ( ( index[ 1 ][ l ] >> WAVE_SH ) + ( out0 & ~am[ l ] ) ) & mask[ 1 ][ l ];
+					Bit32s sample = ( table32[ (Bit32s)( base[ 1 ][ l ] + ( pos >> coarse ) ) ] * mul[ 1 ][ i ][ l ] ) >> MUL_SH;
+					sample += out0 & am[ l ];
+					sumLeft += sample & left[ l ];
+					sumRight += sample & right[ l ];
+				}
+				if ( opl3Mode ) {
+					out[ i * 2 + 0 ] += sumLeft;
+					out[ i * 2 + 1 ] += sumRight;
+				} else {
+					out[ i ] += sumLeft;
+				}
+			}
+			total -= todo;
+			out += opl3Mode ? todo * 2 : todo;
+		}
+		for ( Bitu l = 0; l < lanes; l++ ) {
+			Channel* ch = group[ l ];
+			ch->op[ 0 ].waveIndex = index[ 0 ][ l ];
+			ch->op[ 1 ].waveIndex = index[ 1 ][ l ];
+			ch->old[ 0 ] = old0[ l ];
+			ch->old[ 1 ] = old1[ l ];
+		}
+	}
+}
+
+//The grouped kernel built for every cpu level, the wider ones can gather the lanes at once
+template< bool opl3Mode, int wave >
+static CPU_TARGET_AVX512 void GenerateGroupAvx512( Chip* chip, Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output ) {
+	chip->GenerateGroup< opl3Mode, wave >( group, amMask, count, samples, output );
+}
+
+template< bool opl3Mode, int wave >
+static CPU_TARGET_AVX2 void GenerateGroupAvx2( Chip* chip, Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output ) {
+	chip->GenerateGroup< opl3Mode, wave >( group, amMask, count, samples, output );
+}
+
+template< bool opl3Mode, int wave >
+static void GenerateGroupGeneric( Chip* chip, Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output ) {
+	chip->GenerateGroup< opl3Mode, wave >( group, amMask, count, samples, output );
+}
+
+template< bool opl3Mode, int wave >
+static void GenerateGroupDispatch( Chip* chip, Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output ) {
+	switch ( GetCpuLevel() ) {
+	case CPU_AVX512:
+		GenerateGroupAvx512< opl3Mode, wave >( chip, group, amMask, count, samples, output );
+		break;
+	case CPU_AVX2:
+		GenerateGroupAvx2< opl3Mode, wave >( chip, group, amMask, count, samples, output );
+		break;
+	default:
+		GenerateGroupGeneric< opl3Mode, wave >( chip, group, amMask, count, samples, output );
+		break;
+	}
+}
+
+template< bool opl3Mode >
+Bitu Chip::CollectGroup( Bitu samples, Bit32s* output, Channel** group, Bit32s* amMask ) {
+	Channel* const end = chan + ( opl3Mode ? 18 : 9 );
+	const Bit8u fmMode = opl3Mode ? sm3FM : sm2FM;
+	const Bit8u amMode = opl3Mode ? sm3AM : sm2AM;
+	Bitu count = 0;
+	for( Channel* ch = chan; ch < end; ) {
+		if ( !( activeMask & ( 1 << ( ch - chan ) ) ) ) {
+			ch++;
+			continue;
+		}
+		bool fm = ch->synthMode == fmMode;
+		if ( !fm && ch->synthMode != amMode ) {
+			ch = ch->Block( this, samples, output );
+			continue;
+		}
+		//Same early out as the BlockTemplate for these modes
+		if ( ch->Op(1)->Silent() && ( fm || ch->Op(0)->Silent() ) ) {
+			ch->Sleep( this, 1 );
+		} else {
+			ch->Op(0)->Prepare< true >( this );
+			ch->Op(1)->Prepare< true >( this );
+			amMask[ count ] = fm ? 0 : -1;
+			group[ count++ ] = ch;
+		}
+		ch++;
+	}
+	return count;
+}
+
+template< bool opl3Mode >
+void Chip::GenerateChannels( Bitu samples, Bit32s* output ) {
+	Channel* const end = chan + ( opl3Mode ? 18 : 9 );
+	//The grouped kernel only implements the multiplication tables
+	if ( groupChannels && ( waveMode == WAVE_TABLEMUL || waveMode == WAVE_TABLEFAST ) ) {
+		Channel* group[ 18 ];
+		Bit32s amMask[ 18 ];
+		Bitu count = CollectGroup< opl3Mode >( samples, output, group, amMask );
+		if ( count ) {
+			if ( waveMode == WAVE_TABLEFAST )
+				GenerateGroupDispatch< opl3Mode, WAVE_TABLEFAST >( this, group, amMask, count, samples, output );
+			else
+				GenerateGroupDispatch< opl3Mode, WAVE_TABLEMUL >( this, group, amMask, count, samples, output );
+		}
+		return;
+	}
+	for( Channel* ch = chan; ch < end; ) {
+		//Channels asleep are skipped one at a time, a sleeping block has all its channels cleared
+		if ( !( activeMask & ( 1 << ( ch - chan ) ) ) ) {
+			ch++;
+			continue;
+		}
+		ch = ch->Block( this, samples, output );
+	}
+}
+
 void Chip::GenerateBlock2( Bitu total, Bit32s* output ) {
+	if ( dirtyMask )
+		UpdateOperators();
 	while ( total > 0 ) {
 		Bit32u samples = ForwardLFO( total );
 		memset(output, 0, sizeof(Bit32s) * samples);
-		int count = 0;
-		for( Channel* ch = chan; ch < chan + 9; ) {
-			count++;
-			ch = (ch->*(ch->synthHandler))( this, samples, output );
-		}
+		if ( activeMask )
+			GenerateChannels< false >( samples, output );
 		total -= samples;
 		output += samples;
 	}
 }
 
 void Chip::GenerateBlock3( Bitu total, Bit32s* output  ) {
+	if ( dirtyMask )
+		UpdateOperators();
 	while ( total > 0 ) {
 		Bit32u samples = ForwardLFO( total );
-		memset(output, 0, sizeof(Bit32s) * samples *2);
-		int count = 0;
-		for( Channel* ch = chan; ch < chan + 18; ) {
-			count++;
-			ch = (ch->*(ch->synthHandler))( this, samples, output );
-		}
+		//An idle chip only has to keep its lfo running, noise only runs with percussion
+		if ( activeMask )
+			GenerateChannels< true >( samples, output );
 		total -= samples;
 		output += samples * 2;
 	}
 }
 
-void Chip::Setup( Bit32u rate ) {
+static const RateTables* GetRateTables( Bit32u rate );
+
+//Header of a saved state, the chip and the queued writes follow it
+struct StateHeader {
+	Bit32u version;
+	Bit32u chipSize;
+	Bit32u queued;
+};
+
+//The fields of a saved chip are stored one by one at their own width, in the byte order
+//of the host. Pointers and padding are left out, so are the settings of the handler
+struct StateWriter {
+	std::vector< Bit8u >& state;
+	template< typename T >
+	void operator()( T& value ) {
+		const Bit8u* data = (const Bit8u*)&value;
+		state.insert( state.end(), data, data + sizeof( T ) );
+	}
+};
+
+struct StateReader {
+	const Bit8u* state;
+	template< typename T >
+	void operator()( T& value ) {
+		memcpy( &value, state, sizeof( T ) );
+		state += sizeof( T );
+	}
+};
+
+struct StateSizer {
+	Bitu size;
+	template< typename T >
+	void operator()( T& ) {
+		size += sizeof( T );
+	}
+};
+
+//Every field of a saved chip in the order of the state, the wave bases, starts and masks
+//and the rate tables are derived from them. The wave mode, quality, envelope step and channel
+//groups stay as the chip was set up. The rate is saved since the counters are in its units
+template< typename Visit >
+static void ChipState( Chip& chip, Visit& visit ) {
+	visit( chip.lfoCounter );
+	visit( chip.lfoAdd );
+	visit( chip.noiseCounter );
+	visit( chip.noiseAdd );
+	visit( chip.noiseValue );
+	visit( chip.rate );
+	for ( int i = 0; i < 18; i++ ) {
+		Channel& ch = chip.chan[i];
+		for ( int o = 0; o < 2; o++ ) {
+			Operator& op = ch.op[o];
+			visit( op.waveIndex );
+			visit( op.waveAdd );
+			visit( op.waveCurrent );
+			visit( op.chanData );
+			visit( op.freqMul );
+			visit( op.vibrato );
+			visit( op.sustainLevel );
+			visit( op.totalLevel );
+			visit( op.currentLevel );
+			visit( op.preparedStamp );
+			visit( op.volume );
+			visit( op.attackAdd );
+			visit( op.decayAdd );
+			visit( op.releaseAdd );
+			visit( op.rateIndex );
+			visit( op.rateZero );
+			visit( op.keyOn );
+			visit( op.reg20 );
+			visit( op.reg40 );
+			visit( op.reg60 );
+			visit( op.reg80 );
+			visit( op.regE0 );
+			visit( op.state );
+			visit( op.tremoloMask );
+			visit( op.vibStrength );
+			visit( op.ksr );
+			visit( op.waveForm );
+			visit( op.dirty );
+		}
+		visit( ch.synthMode );
+		visit( ch.chanData );
+		visit( ch.old[0] );
+		visit( ch.old[1] );
+		visit( ch.feedback );
+		visit( ch.regB0 );
+		visit( ch.regC0 );
+		visit( ch.fourMask );
+		visit( ch.maskLeft );
+		visit( ch.maskRight );
+	}
+	visit( chip.reg104 );
+	visit( chip.reg08 );
+	visit( chip.reg04 );
+	visit( chip.regBD );
+	visit( chip.vibratoIndex );
+	visit( chip.tremoloIndex );
+	visit( chip.vibratoSign );
+	visit( chip.vibratoShift );
+	visit( chip.tremoloValue );
+	visit( chip.vibratoStrength );
+	visit( chip.tremoloStrength );
+	visit( chip.waveFormMask );
+	visit( chip.opl3Active );
+	visit( chip.activeMask );
+	visit( chip.dirtyMask );
+	visit( chip.prepareStamp );
+}
+
+Bitu Chip::StateSize() {
+	static Chip chip;
+	StateSizer sizer = { 0 };
+	ChipState( chip, sizer );
+	return sizer.size;
+}
+
+void Chip::SaveState( std::vector< Bit8u >& state ) const {
+	StateWriter writer = { state };
+	ChipState( const_cast< Chip& >( *this ), writer );
+}
+
+//Frequency and block in the low 13 bits, the key code in the top byte is below 16
+static bool ValidChanData( Bit32u data ) {
+	return ( data & 0xffff ) < ( 1 << 13 ) && ( data >> SHIFT_KEYCODE ) < 16;
+}
+
+//Check the values of a restored chip that select tables, shifts or channels
+static bool ValidState( const Chip& chip ) {
+	switch ( chip.waveMode ) {
+	case WAVE_HANDLER:
+	case WAVE_TABLELOG:
+	case WAVE_TABLEMUL:
+	case WAVE_TABLEFAST:
+		break;
+	default:
+		return false;
+	}
+	if ( chip.quality == DBOPL_QUALITY_FAST ) {
+		if ( chip.envelopeStep != ENV_FAST_STEP || chip.waveMode != WAVE_TABLEFAST )
+			return false;
+	} else if ( chip.quality != DBOPL_QUALITY_EXACT || chip.envelopeStep != 1 ) {
+		return false;
+	}
+	//Rates outside of this range overflow while the rate tables are set up
+	if ( chip.rate < 8000 || chip.rate > 192000 )
+		return false;
+	if ( chip.lfoCounter >= LFO_MAX || chip.vibratoIndex >= 32 || chip.tremoloIndex >= TREMOLO_TABLE )
+		return false;
+	if ( chip.vibratoStrength > 1 || chip.tremoloStrength > 2 )
+		return false;
+	if ( ( chip.activeMask | chip.dirtyMask ) & ~ACTIVE_ALL )
+		return false;
+	if ( chip.opl3Active != 0 && chip.opl3Active != -1 )
+		return false;
+	for ( int i = 0; i < 18; i++ ) {
+		const Channel& ch = chip.chan[i];
+		if ( ch.fourMask != FourMaskTable[i] || ch.feedback > 31 || !ValidChanData( ch.chanData ) )
+			return false;
+		if ( ( ch.maskLeft != 0 && ch.maskLeft != -1 ) || ( ch.maskRight != 0 && ch.maskRight != -1 ) )
+			return false;
+		//Feedback samples come from a single operator, far below 16 bits
+		if ( labs( ch.old[0] ) >= ( 1 << 16 ) || labs( ch.old[1] ) >= ( 1 << 16 ) )
+			return false;
+		//The block of a mode has to fit in the channels from here on
+		Bitu needed = 1;
+		switch ( ch.synthMode ) {
+		case sm2AM:
+		case sm2FM:
+		case sm3AM:
+		case sm3FM:
+			break;
+		case sm3FMFM:
+		case sm3AMFM:
+		case sm3FMAM:
+		case sm3AMAM:
+			needed = 2;
+			break;
+		case sm2Percussion:
+		case sm3Percussion:
+			needed = 3;
+			break;
+		default:
+			return false;
+		}
+		if ( i + needed > 18 )
+			return false;
+		for ( int o = 0; o < 2; o++ ) {
+			const Operator& op = ch.op[o];
+			if ( op.waveForm >= 8 || op.state > Operator::ATTACK || op.ksr >= 16 || !ValidChanData( op.chanData ) )
+				return false;
+			if ( op.dirty & ~( Operator::DIRTY_RATES | Operator::DIRTY_LEVEL | Operator::DIRTY_FREQUENCY | Operator::DIRTY_WAVE ) )
+				return false;
+		}
+	}
+	return true;
+}
+
+bool Chip::RestoreState( const Bit8u* state, Bitu size ) {
+	if ( size < StateSize() )
+		return false;
+	//Checked in a copy first so a damaged state leaves this chip alone, the copy
+	//starts out with the settings of this chip
+	Chip restored( *this );
+	StateReader reader = { state };
+	ChipState( restored, reader );
+	if ( !ValidState( restored ) )
+		return false;
+	*this = restored;
+	rates = GetRateTables( rate );
+	for ( int i = 0; i < 18; i++ ) {
+		for ( int o = 0; o < 2; o++ ) {
+			Operator& op = chan[i].op[o];
+			op.UpdateWaveBase( this );
+			op.waveMask = WaveMaskTable[ op.waveForm ];
+			op.waveStart = waveMode == WAVE_HANDLER ? 0 : WaveStartTable[ op.waveForm ] << WAVE_SH;
+		}
+	}
+	return true;
+}
+
+static double RateScale( Bit32u rate ) {
 	double original = OPLRATE;
 //	double original = rate;
-	double scale = original / (double)rate;
+	//The native rate gets the exact increments of the chip, it's only rounded for the output
+	if ( rate == DBOPL_NATIVE_RATE )
+		return 1.0;
+	return original / (double)rate;
+}
 
-	//Noise counter is run at the same precision as general waves
-	noiseAdd = (Bit32u)( 0.5 + scale * ( 1 << LFO_SH ) );
-	noiseCounter = 0;
-	noiseValue = 1;	//Make sure it triggers the noise xor the first time
-	//The low frequency oscillation counter
-	//Every time his overflows vibrato and tremoloindex are increased
-	lfoAdd = (Bit32u)( 0.5 + scale * ( 1 << LFO_SH ) );
-	lfoCounter = 0;
-	vibratoIndex = 0;
-	tremoloIndex = 0;
+void RateTables::Setup( Bit32u rate ) {
+	double scale = RateScale( rate );
+	this->rate = rate;
 
 	//With higher octave this gets shifted up
 	//-1 since the freqCreateTable = *2
@@ -1321,12 +1996,13 @@ void Chip::Setup( Bit32u rate ) {
 			//Below our target
 			if ( diff < 0 ) {
 				//Better than the last time
-				Bit32s mul = ((original - diff) << 12) / original;
-				guessAdd = ((guessAdd * mul) >> 12);
+				Bit32s mul = (Bit32s)( ( (Bit64s)( original - diff ) << 12 ) / original );
+				//The product overflows 32 bits for the long attacks at high rates
+				guessAdd = (Bit32s)( ( (Bit64s)guessAdd * mul ) >> 12 );
 				guessAdd++;
 			} else if ( diff > 0 ) {
-				Bit32s mul = ((original - diff) << 12) / original;
-				guessAdd = (guessAdd * mul) >> 12;
+				Bit32s mul = (Bit32s)( ( (Bit64s)( original - diff ) << 12 ) / original );
+				guessAdd = (Bit32s)( ( (Bit64s)guessAdd * mul ) >> 12 );
 				guessAdd--;
 			}
 		}
@@ -1341,26 +2017,44 @@ void Chip::Setup( Bit32u rate ) {
 		//This should provide instant volume maximizing
 		attackRates[i] = 8 << RATE_SH;
 	}
-	//Setup the channels with the correct four op flags
+}
+
+//Chips running at the same rate share their tables, which stay around till the end
+static const RateTables* GetRateTables( Bit32u rate ) {
+	static std::mutex lock;
+	static std::vector< RateTables* > cache;
+	std::lock_guard< std::mutex > guard( lock );
+	for ( size_t i = 0; i < cache.size(); i++ ) {
+		if ( cache[i]->rate == rate )
+			return cache[i];
+	}
+	RateTables* tables = new RateTables;
+	tables->Setup( rate );
+	cache.push_back( tables );
+	return tables;
+}
+
+void Chip::Setup( Bit32u rate ) {
+	double scale = RateScale( rate );
+
+	//Noise counter is run at the same precision as general waves
+	noiseAdd = (Bit32u)( 0.5 + scale * ( 1 << LFO_SH ) );
+	noiseCounter = 0;
+	noiseValue = 1;	//Make sure it triggers the noise xor the first time
+	//The low frequency oscillation counter
+	//Every time his overflows vibrato and tremoloindex are increased
+	lfoAdd = (Bit32u)( 0.5 + scale * ( 1 << LFO_SH ) );
+	lfoCounter = 0;
+	vibratoIndex = 0;
+	tremoloIndex = 0;
+	this->rate = rate;
+	rates = GetRateTables( rate );
+
+	//Setup the channels with the correct four op flags and mark the percussion channels
 	//Channels are accessed through a table so they appear linear here
-	chan[ 0].fourMask = 0x00 | ( 1 << 0 );
-	chan[ 1].fourMask = 0x80 | ( 1 << 0 );
-	chan[ 2].fourMask = 0x00 | ( 1 << 1 );
-	chan[ 3].fourMask = 0x80 | ( 1 << 1 );
-	chan[ 4].fourMask = 0x00 | ( 1 << 2 );
-	chan[ 5].fourMask = 0x80 | ( 1 << 2 );
-
-	chan[ 9].fourMask = 0x00 | ( 1 << 3 );
-	chan[10].fourMask = 0x80 | ( 1 << 3 );
-	chan[11].fourMask = 0x00 | ( 1 << 4 );
-	chan[12].fourMask = 0x80 | ( 1 << 4 );
-	chan[13].fourMask = 0x00 | ( 1 << 5 );
-	chan[14].fourMask = 0x80 | ( 1 << 5 );
-
-	//mark the percussion channels
-	chan[ 6].fourMask = 0x40;
-	chan[ 7].fourMask = 0x40;
-	chan[ 8].fourMask = 0x40;
+	for ( int i = 0; i < 18; i++ ) {
+		chan[i].fourMask = FourMaskTable[i];
+	}
 
 	//Clear Everything in opl3 mode
 	WriteReg( 0x105, 0x1 );
@@ -1378,188 +2072,396 @@ void Chip::Setup( Bit32u rate ) {
 	}
 }
 
-static bool doneTables = false;
-void InitTables( void ) {
-	if ( doneTables )
+Bit32u Handler::WriteAddr( Bit32u port, Bit8u val ) {
+	return chip.WriteAddr( port, val );
+
+}
+void Handler::WriteReg( Bit32u addr, Bit8u val ) {
+	chip.WriteReg( addr, val );
+}
+
+void Handler::QueueReg( Bitu offset, Bit32u addr, Bit8u val ) {
+	if ( !queue.empty() && queue.back().offset > offset )
+		offset = queue.back().offset;
+	QueuedWrite write = { offset, addr, val };
+	queue.push_back( write );
+}
+
+void Handler::QueueSplit( Bitu offset ) {
+	QueueReg( offset, QUEUED_SPLIT, 0 );
+}
+
+void Handler::Generate( Bit32s* output, Bitu samples, bool accumulate ) {
+	if ( queue.empty() ) {
+		GenerateBlock( output, samples, accumulate );
 		return;
-	doneTables = true;
-#if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
-	//Exponential volume table, same as the real adlib
-	for ( int i = 0; i < 256; i++ ) {
-		//Save them in reverse
-		ExpTable[i] = (int)( 0.5 + ( pow(2.0, ( 255 - i) * ( 1.0 /256 ) )-1) * 1024 );
-		ExpTable[i] += 1024; //or remove the -1 oh well :)
-		//Preshift to the left once so the final volume can shift to the right
-		ExpTable[i] *= 2;
-	}
-#endif
-#if ( DBOPL_WAVE == WAVE_HANDLER )
-	//Add 0.5 for the trunc rounding of the integer cast
-	//Do a PI sinetable instead of the original 0.5 PI
-	for ( int i = 0; i < 512; i++ ) {
-		SinTable[i] = (Bit16s)( 0.5 - log10( sin( (i + 0.5) * (PI / 512.0) ) ) / log10(2.0)*256 );
-	}
-#endif
-#if ( DBOPL_WAVE == WAVE_TABLEMUL )
-	//Multiplication based tables
-	for ( int i = 0; i < 384; i++ ) {
-		int s = i * 8;
-		//TODO maybe keep some of the precision errors of the original table?
-		double val = ( 0.5 + ( pow(2.0, -1.0 + ( 255 - s) * ( 1.0 /256 ) )) * ( 1 << MUL_SH ));
-		MulTable[i] = (Bit16u)(val);
 	}
+	//Only split the rendering where the queued writes are
+	Bitu done = 0;
+	size_t next = 0;
+	for ( ;; ) {
+		while ( next < queue.size() && queue[ next ].offset <= done ) {
+			if ( queue[ next ].addr != QUEUED_SPLIT )
+				chip.WriteReg( queue[ next ].addr, queue[ next ].val );
+			next++;
+		}
+		if ( done >= samples )
+			break;
+		Bitu todo = samples - done;
+		if ( next < queue.size() && queue[ next ].offset < samples )
+			todo = queue[ next ].offset - done;
+		GenerateBlock( output + done * 2, todo, accumulate );
+		done += todo;
+	}
+	queue.erase( queue.begin(), queue.begin() + next );
+	for ( size_t i = 0; i < queue.size(); i++ )
+		queue[ i ].offset -= samples;
+}
 
-	//Sine Wave Base
-	for ( int i = 0; i < 512; i++ ) {
-		WaveTable[ 0x0200 + i ] = (Bit16s)(sin( (i + 0.5) * (PI / 512.0) ) * 4084);
-		WaveTable[ 0x0000 + i ] = -WaveTable[ 0x200 + i ];
-	}
-	//Exponential wave
-	for ( int i = 0; i < 256; i++ ) {
-		WaveTable[ 0x700 + i ] = (Bit16s)( 0.5 + ( pow(2.0, -1.0 + ( 255 - i * 8) * ( 1.0 /256 ) ) ) * 4085 );
-		WaveTable[ 0x6ff - i ] = -WaveTable[ 0x700 + i ];
+//A chip rendered by GenerateMulti, with the lanes of its current lfo block
+struct MultiChip {
+	Handler* handler;
+	//Next queued write and the end of the part before it
+	size_t next;
+	Bitu segment;
+	//Start and end of the current lfo block
+	Bitu start;
+	Bitu end;
+	Bitu lanes;
+	Channel* group[ 18 ];
+	Bit32s amMask[ 18 ];
+};
+
+//Only the stereo output of a chip that stays in opl3 mode can share the lanes
+static bool MultiLanes( const Handler& handler, Bitu samples ) {
+	const Chip& chip = handler.chip;
+	if ( !chip.opl3Active || !chip.groupChannels || chip.waveMode != WAVE_TABLEMUL || chip.quality != DBOPL_QUALITY_EXACT )
+		return false;
+	for ( size_t i = 0; i < handler.queue.size() && handler.queue[ i ].offset < samples; i++ ) {
+		if ( handler.queue[ i ].addr == 0x105 )
+			return false;
 	}
-#endif
-#if ( DBOPL_WAVE == WAVE_TABLELOG )
-	//Sine Wave Base
-	for ( int i = 0; i < 512; i++ ) {
-		WaveTable[ 0x0200 + i ] = (Bit16s)( 0.5 - log10( sin( (i + 0.5) * (PI / 512.0) ) ) / log10(2.0)*256 );
-		WaveTable[ 0x0000 + i ] = ((Bit16s)0x8000) | WaveTable[ 0x200 + i];
-	}
-	//Exponential wave
-	for ( int i = 0; i < 256; i++ ) {
-		WaveTable[ 0x700 + i ] = i * 8;
-		WaveTable[ 0x6ff - i ] = ((Bit16s)0x8000) | i * 8;
-	} 
-#endif
+	return true;
+}
 
-	//	|    |//\\|____|WAV7|//__|/\  |____|/\/\|
-	//	|\\//|    |    |WAV7|    |  \/|    |    |
-	//	|06  |0126|27  |7   |3   |4   |4 5 |5   |
-
-#if (( DBOPL_WAVE == WAVE_TABLELOG ) || ( DBOPL_WAVE == WAVE_TABLEMUL ))
-	for ( int i = 0; i < 256; i++ ) {
-		//Fill silence gaps
-		WaveTable[ 0x400 + i ] = WaveTable[0];
-		WaveTable[ 0x500 + i ] = WaveTable[0];
-		WaveTable[ 0x900 + i ] = WaveTable[0];
-		WaveTable[ 0xc00 + i ] = WaveTable[0];
-		WaveTable[ 0xd00 + i ] = WaveTable[0];
-		//Replicate sines in other pieces
-		WaveTable[ 0x800 + i ] = WaveTable[ 0x200 + i ];
-		//double speed sines
-		WaveTable[ 0xa00 + i ] = WaveTable[ 0x200 + i * 2 ];
-		WaveTable[ 0xb00 + i ] = WaveTable[ 0x000 + i * 2 ];
-		WaveTable[ 0xe00 + i ] = WaveTable[ 0x200 + i * 2 ];
-		WaveTable[ 0xf00 + i ] = WaveTable[ 0x200 + i * 2 ];
-	} 
-#endif
+//Start the next lfo block of a chip, the way Handler::Generate and GenerateBlock3
+//would, rendering the channels that don't go in the lanes
+static void MultiBlock( MultiChip& multi, Bitu samples, Bit32s* output ) {
+	Handler& handler = *multi.handler;
+	Chip& chip = handler.chip;
+	Bitu t = multi.end;
+	if ( t == multi.segment ) {
+		while ( multi.next < handler.queue.size() && handler.queue[ multi.next ].offset <= t ) {
+			if ( handler.queue[ multi.next ].addr != Handler::QUEUED_SPLIT )
+				chip.WriteReg( handler.queue[ multi.next ].addr, handler.queue[ multi.next ].val );
+			multi.next++;
+		}
+		multi.segment = samples;
+		if ( multi.next < handler.queue.size() && handler.queue[ multi.next ].offset < samples )
+			multi.segment = handler.queue[ multi.next ].offset;
+		if ( chip.dirtyMask )
+			chip.UpdateOperators();
+	}
+	Bit32u todo = chip.ForwardLFO( (Bit32u)( multi.segment - t ) );
+	multi.start = t;
+	multi.end = t + todo;
+	multi.lanes = 0;
+	if ( chip.activeMask )
+		multi.lanes = chip.CollectGroup< true >( todo, output + t * 2, multi.group, multi.amMask );
+}
 
-	//Create the ksl table
-	for ( int oct = 0; oct < 8; oct++ ) {
-		int base = oct * 8;
-		for ( int i = 0; i < 16; i++ ) {
-			int val = base - KslCreateTable[i];
-			if ( val < 0 )
-				val = 0;
-			//*4 for the final range to match attenuation range
-			KslTable[ oct * 16 + i ] = val * 4;
+void GenerateMulti( Handler** handlers, Bitu count, Bitu samples, Bit32s* output ) {
+	static thread_local std::vector< MultiChip > multi;
+	static thread_local std::vector< Channel* > group;
+	static thread_local std::vector< Bit32s > amMask;
+	memset( output, 0, sizeof(Bit32s) * samples * 2 );
+	multi.clear();
+	for ( Bitu i = 0; i < count; i++ ) {
+		if ( MultiLanes( *handlers[ i ], samples ) ) {
+			MultiChip chip;
+			chip.handler = handlers[ i ];
+			chip.next = chip.segment = chip.start = chip.end = chip.lanes = 0;
+			multi.push_back( chip );
+		} else {
+			handlers[ i ]->Generate( output, samples, true );
 		}
 	}
-	//Create the Tremolo table, just increase and decrease a triangle wave
-	for ( Bit8u i = 0; i < TREMOLO_TABLE / 2; i++ ) {
-		Bit8u val = i << ENV_EXTRA;
-		TremoloTable[i] = val;
-		TremoloTable[TREMOLO_TABLE - 1 - i] = val;
+	//A single chip has nothing to share its lanes with
+	if ( multi.size() < 2 ) {
+		for ( size_t i = 0; i < multi.size(); i++ )
+			multi[ i ].handler->Generate( output, samples, true );
+		return;
 	}
-	//Create a table with offsets of the channels from the start of the chip
-	DBOPL::Chip* chip = 0;
-	for ( Bitu i = 0; i < 32; i++ ) {
-		Bitu index = i & 0xf;
-		if ( index >= 9 ) {
-			ChanOffsetTable[i] = 0;
-			continue;
+	group.resize( multi.size() * 18 );
+	amMask.resize( multi.size() * 18 );
+	//The chips only have to agree on where a block starts to share the lanes. The lfo
+	//blocks of chips that started together line up, so mostly only the chips with a write
+	//inside a block render it on their own and the others don't get split up at that write
+	for ( ;; ) {
+		Bitu t = samples;
+		for ( size_t i = 0; i < multi.size(); i++ ) {
+			if ( multi[ i ].end < t )
+				t = multi[ i ].end;
 		}
-		//Make sure the four op channels follow eachother
-		if ( index < 6 ) {
-			index = (index % 3) * 2 + ( index / 3 );
+		if ( t >= samples )
+			break;
+		for ( size_t i = 0; i < multi.size(); i++ ) {
+			if ( multi[ i ].end == t )
+				MultiBlock( multi[ i ], samples, output );
+		}
+		//Every chip starting at t renders up to its end, together with the others ending there
+		for ( size_t i = 0; i < multi.size(); i++ ) {
+			if ( multi[ i ].start != t )
+				continue;
+			Bitu end = multi[ i ].end;
+			Bitu lanes = 0;
+			for ( size_t j = i; j < multi.size(); j++ ) {
+				if ( multi[ j ].start != t || multi[ j ].end != end )
+					continue;
+				for ( Bitu l = 0; l < multi[ j ].lanes; l++ ) {
+					group[ lanes ] = multi[ j ].group[ l ];
+					amMask[ lanes++ ] = multi[ j ].amMask[ l ];
+				}
+				//Done with this block, the next round starts it at end
+				multi[ j ].start = end;
+			}
+			//Only the envelope step of the chip is used and the exact quality has the same for all
+			if ( lanes )
+				GenerateGroupDispatch< true, WAVE_TABLEMUL >( &multi[ i ].handler->chip, &group[ 0 ], &amMask[ 0 ], lanes, end - t, output + t * 2 );
 		}
-		//Add back the bits for highest ones
-		if ( i >= 16 )
-			index += 9;
-		Bitu blah = reinterpret_cast<unsigned long long>( &(chip->chan[ index ]) );
-		ChanOffsetTable[i] = blah;
 	}
-	//Same for operators
-	for ( Bitu i = 0; i < 64; i++ ) {
-		if ( i % 8 >= 6 || ( (i / 8) % 4 == 3 ) ) {
-			OpOffsetTable[i] = 0;
-			continue;
+	//Writes on the last sample still go in, the rest of the queue moves on like in Handler::Generate
+	for ( size_t i = 0; i < multi.size(); i++ ) {
+		Handler& handler = *multi[ i ].handler;
+		size_t next = multi[ i ].next;
+		while ( next < handler.queue.size() && handler.queue[ next ].offset <= samples ) {
+			if ( handler.queue[ next ].addr != Handler::QUEUED_SPLIT )
+				handler.chip.WriteReg( handler.queue[ next ].addr, handler.queue[ next ].val );
+			next++;
 		}
-		Bitu chNum = (i / 8) * 3 + (i % 8) % 3;
-		//Make sure we use 16 and up for the 2nd range to match the chanoffset gap
-		if ( chNum >= 12 )
-			chNum += 16 - 12;
-		Bitu opNum = ( i % 8 ) / 3;
-		DBOPL::Channel* chan = 0;
-		Bitu blah = reinterpret_cast<unsigned long long>( &(chan->op[opNum]) );
-		OpOffsetTable[i] = ChanOffsetTable[ chNum ] + blah;
+		handler.queue.erase( handler.queue.begin(), handler.queue.begin() + next );
+		for ( size_t q = 0; q < handler.queue.size(); q++ )
+			handler.queue[ q ].offset -= samples;
 	}
-#if 0
-	//Stupid checks if table's are correct
-	for ( Bitu i = 0; i < 18; i++ ) {
-		Bit32u find = (Bit16u)( &(chip->chan[ i ]) );
-		for ( Bitu c = 0; c < 32; c++ ) {
-			if ( ChanOffsetTable[c] == find ) {
-				find = 0;
-				break;
+}
+
+//Render a chip into interleaved stereo, Handler::GenerateBlock without the threads
+static void RenderChip( Chip& chip, Bit32s* output, Bitu samples, bool accumulate ) {
+	if ( chip.opl3Active ) {
+		if ( !accumulate )
+			memset( output, 0, sizeof(Bit32s) * samples * 2 );
+		chip.GenerateBlock3( samples, output );
+		return;
+	}
+	//Mono output goes through a small buffer to be copied to both sides,
+	//sized for stereo since percussion can keep its opl3 handler after a switch
+	Bit32s buffer[ 512 * 2 ];
+	while ( samples > 0 ) {
+		Bitu todo = samples > 512 ? 512 : samples;
+		chip.GenerateBlock2( todo, buffer );
+		if ( accumulate ) {
+			for ( Bitu i = 0; i < todo; i++ ) {
+				output[ i * 2 + 0 ] += buffer[ i ];
+				output[ i * 2 + 1 ] += buffer[ i ];
+			}
+		} else {
+			for ( Bitu i = 0; i < todo; i++ ) {
+				output[ i * 2 + 0 ] = buffer[ i ];
+				output[ i * 2 + 1 ] = buffer[ i ];
 			}
 		}
-		if ( find ) {
-			find = find;
+		samples -= todo;
+		output += todo * 2;
+	}
+}
+
+#ifdef _OPENMP
+//Waking up the threads and merging costs up to about 5 microseconds a block, rendering
+//about 37 nanoseconds per channel and sample. Two threads only win on blocks of more
+//than about 270 channel samples, below this many the block is rendered on one thread
+#define SPLIT_MIN_WORK 512
+
+//Copy all of a chip but its channels, the chip is plain data like SaveState assumes
+static void CopyChipShared( Chip& to, const Chip& from ) {
+	const size_t begin = offsetof( Chip, chan );
+	const size_t end = begin + sizeof( from.chan );
+	memcpy( (Bit8u*)&to, (const Bit8u*)&from, begin );
+	memcpy( (Bit8u*)&to + end, (const Bit8u*)&from + end, sizeof( Chip ) - end );
+}
+
+void Handler::GenerateSplit( Bit32s* output, Bitu samples, bool accumulate ) {
+	Bitu threads = channelThreads ? channelThreads : omp_get_max_threads();
+	//Derived state has to be current before the chip gets copied
+	if ( chip.dirtyMask )
+		chip.UpdateOperators();
+	//Channels woken together share state through 4 op pairs or percussion, so they go together
+	Bit32u units[ 18 ];
+	Bitu count = 0;
+	Bitu channels = 0;
+	Bit32u seen = 0;
+	const Bit32u used = chip.opl3Active ? ACTIVE_ALL : ( 1 << 9 ) - 1;
+	for ( Bitu i = 0; i < 18; i++ ) {
+		Bit32u unit = ChannelGroupTable[ i ];
+		if ( chip.activeMask & used & ( 1 << i ) )
+			channels++;
+		if ( seen & unit )
+			continue;
+		seen |= unit;
+		if ( chip.activeMask & unit & used )
+			units[ count++ ] = unit;
+	}
+	if ( threads > count )
+		threads = count;
+	if ( threads < 2 || channels * samples < SPLIT_MIN_WORK ) {
+		RenderChip( chip, output, samples, accumulate );
+		return;
+	}
+	Bit32u masks[ 18 ] = { 0 };
+	for ( Bitu u = 0; u < count; u++ ) {
+		masks[ u % threads ] |= units[ u ];
+	}
+	//The other parts run on copies of the chip, the lfo and noise only depend on time so
+	//every copy steps them the same way. Noise only runs for the part with the percussion.
+	//The copies stay around, each block only brings over the state outside of the channels
+	//and the channels of the part, the others aren't looked at
+	const Bit32u active = chip.activeMask;
+	splitChips.resize( threads - 1 );
+	splitBuffer.resize( ( threads - 1 ) * samples * 2 );
+	for ( Bitu p = 1; p < threads; p++ ) {
+		Chip& part = splitChips[ p - 1 ];
+		CopyChipShared( part, chip );
+		for ( Bitu i = 0; i < 18; i++ ) {
+			if ( masks[ p ] & ( 1 << i ) )
+				part.chan[ i ] = chip.chan[ i ];
 		}
+		part.activeMask = active & masks[ p ];
 	}
-	for ( Bitu i = 0; i < 36; i++ ) {
-		Bit32u find = (Bit16u)( &(chip->chan[ i / 2 ].op[i % 2]) );
-		for ( Bitu c = 0; c < 64; c++ ) {
-			if ( OpOffsetTable[c] == find ) {
-				find = 0;
-				break;
-			}
+	chip.activeMask = active & masks[ 0 ];
+	#pragma omp parallel for num_threads( threads ) schedule( static, 1 )
+	for ( Bitu p = 0; p < threads; p++ ) {
+		if ( !p )
+			RenderChip( chip, output, samples, accumulate );
+		else
+			RenderChip( splitChips[ p - 1 ], &splitBuffer[ ( p - 1 ) * samples * 2 ], samples, false );
+	}
+	//Take back the channels of the copies and mix them in, integer adds keep it exact
+	for ( Bitu p = 1; p < threads; p++ ) {
+		const Chip& part = splitChips[ p - 1 ];
+		chip.activeMask |= part.activeMask & masks[ p ];
+		for ( Bitu i = 0; i < 18; i++ ) {
+			if ( masks[ p ] & ( 1 << i ) )
+				chip.chan[ i ] = part.chan[ i ];
+		}
+		if ( masks[ p ] & ChannelGroupTable[ 6 ] ) {
+			chip.noiseCounter = part.noiseCounter;
+			chip.noiseValue = part.noiseValue;
 		}
-		if ( find ) {
-			find = find;
+		const Bit32s* src = &splitBuffer[ ( p - 1 ) * samples * 2 ];
+		#pragma omp simd
+		for ( Bitu i = 0; i < samples * 2; i++ ) {
+			output[ i ] += src[ i ];
 		}
 	}
+}
+#endif
+
+void Handler::GenerateBlock( Bit32s* output, Bitu samples, bool accumulate ) {
+#ifdef _OPENMP
+	if ( channelThreads != 1 && !omp_in_parallel() ) {
+		GenerateSplit( output, samples, accumulate );
+		return;
+	}
 #endif
+	RenderChip( chip, output, samples, accumulate );
 }
 
-Bit32u Handler::WriteAddr( Bit32u port, Bit8u val ) {
-	return chip.WriteAddr( port, val );
+//A queued write is stored field by field, without the padding of the struct
+#define QUEUED_STATE_SIZE ( sizeof( Bit32u ) * 2 + 1 )
+
+void Handler::SaveState( std::vector< Bit8u >& state ) const {
+	StateHeader header = { DBOPL_STATE_VERSION, (Bit32u)Chip::StateSize(), (Bit32u)queue.size() };
+	const Bit8u* data = (const Bit8u*)&header;
+	state.insert( state.end(), data, data + sizeof( header ) );
+	chip.SaveState( state );
+	for ( size_t i = 0; i < queue.size(); i++ ) {
+		Bit8u write[ QUEUED_STATE_SIZE ];
+		//Offsets stay within a single render, far below 32 bits
+		Bit32u offset = (Bit32u)queue[i].offset;
+		memcpy( write, &offset, sizeof( offset ) );
+		memcpy( write + sizeof( offset ), &queue[i].addr, sizeof( queue[i].addr ) );
+		write[ QUEUED_STATE_SIZE - 1 ] = queue[i].val;
+		state.insert( state.end(), write, write + QUEUED_STATE_SIZE );
+	}
+}
 
+Bitu Handler::RestoreState( const Bit8u* state, Bitu size ) {
+	StateHeader header;
+	if ( size < sizeof( header ) )
+		return 0;
+	memcpy( &header, state, sizeof( header ) );
+	//States from another version of the emulator don't fit
+	const Bitu chipSize = Chip::StateSize();
+	if ( header.version != DBOPL_STATE_VERSION || header.chipSize != chipSize )
+		return 0;
+	if ( size < sizeof( header ) + chipSize )
+		return 0;
+	if ( ( size - sizeof( header ) - chipSize ) / QUEUED_STATE_SIZE < header.queued )
+		return 0;
+	Bitu total = sizeof( header ) + chipSize + header.queued * QUEUED_STATE_SIZE;
+	//Writes go to a register or split the rendering, in the order of their offsets
+	std::vector< QueuedWrite > restored( header.queued );
+	const Bit8u* data = state + sizeof( header ) + chipSize;
+	for ( size_t i = 0; i < restored.size(); i++, data += QUEUED_STATE_SIZE ) {
+		Bit32u offset;
+		memcpy( &offset, data, sizeof( offset ) );
+		memcpy( &restored[i].addr, data + sizeof( offset ), sizeof( restored[i].addr ) );
+		restored[i].offset = offset;
+		restored[i].val = data[ QUEUED_STATE_SIZE - 1 ];
+		if ( restored[i].addr > 0x1ff && restored[i].addr != QUEUED_SPLIT )
+			return 0;
+		if ( i && restored[i].offset < restored[i - 1].offset )
+			return 0;
+	}
+	if ( !chip.RestoreState( state + sizeof( header ), chipSize ) )
+		return 0;
+	queue.swap( restored );
+	return total;
 }
-void Handler::WriteReg( Bit32u addr, Bit8u val ) {
-	chip.WriteReg( addr, val );
+
+void Handler::SetChannelGroups( bool enable ) {
+	chip.groupChannels = enable;
 }
 
-void Handler::Generate( void(*AddSamples_m32)(Bitu,Bit32s*),
-	                    void(*AddSamples_s32)(Bitu,Bit32s*),
-	                    Bitu samples ) {
-	Bit32s buffer[ 512 * 2 ];
-	if ( GCC_UNLIKELY(samples > 512) )
-		samples = 512;
-	if ( !chip.opl3Active ) {
-		chip.GenerateBlock2( samples, buffer );
-		AddSamples_m32( samples, buffer );
-	} else {
-		chip.GenerateBlock3( samples, buffer );
-		AddSamples_s32( samples, buffer );
-	}
+void Handler::SetChannelThreads( Bitu threads ) {
+	channelThreads = threads;
+}
+
+Handler::Handler() {
+	channelThreads = 1;
 }
 
-void Handler::Init( Bitu rate ) {
-	InitTables();
+void Handler::Init( Bitu rate, Bitu waveMode, Bitu quality ) {
+	switch ( waveMode ) {
+	case WAVE_HANDLER:
+	case WAVE_TABLELOG:
+	case WAVE_TABLEMUL:
+		break;
+	default:
+		waveMode = DBOPL_WAVE;
+		break;
+	}
+	if ( quality == DBOPL_QUALITY_FAST ) {
+		waveMode = WAVE_TABLEFAST;
+		chip.envelopeStep = ENV_FAST_STEP;
+	} else {
+		quality = DBOPL_QUALITY_EXACT;
+		chip.envelopeStep = 1;
+	}
+	chip.quality = quality;
+	//Setup writes all the registers so the operators pick up the tables of this mode
+	chip.waveMode = waveMode;
 	chip.Setup( rate );
+	queue.clear();
 }
 
 
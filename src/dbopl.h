@@ -19,8 +19,10 @@
 
 /* BEGIN MIDIPLAY GLUE */
 #include <stdint.h>
+#include <vector>
 typedef unsigned long Bitu;
 typedef   signed long Bits;
+typedef int64_t  Bit64s;
 typedef unsigned Bit32u;
 typedef int      Bit32s;
 typedef unsigned short Bit16u;
@@ -28,6 +30,12 @@ typedef signed   short Bit16s;
 typedef unsigned char Bit8u;
 typedef signed   char Bit8s;
 #define INLINE inline
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+#define DB_FASTCALL
 #define GCC_UNLIKELY(x) __builtin_expect((x),0)
 #define GCC_LIKELY(x)   __builtin_expect((x),1)
 /* END MIDIPLAY GLUE */
@@ -38,22 +46,31 @@ typedef signed   char Bit8s;
 #define WAVE_TABLELOG	11
 //Use a linear wavetable with a multiply table for volume
 #define WAVE_TABLEMUL	12
+//Multiply table with a coarser linear wavetable, only picked by the fast quality
+#define WAVE_TABLEFAST	13
 
-//Select the type of wave generator routine
+//Default type of wave generator routine, all of them are compiled in and Handler::Init can pick another
 #define DBOPL_WAVE WAVE_TABLEMUL
 
+//Sample rate of the real chip, the 14.31818 MHz clock divided by 288
+#define DBOPL_NATIVE_CLOCK ( 14318180.0 / 288.0 )
+//Init at this rate runs the chip unscaled, a sample per cycle of the real one
+#define DBOPL_NATIVE_RATE 49716
+
+//Version of the saved state layout, increase it whenever the fields a chip saves change
+#define DBOPL_STATE_VERSION 6
+
+//Quality tiers for Handler::Init, the fast one trades some accuracy for less cpu time
+#define DBOPL_QUALITY_EXACT	0
+#define DBOPL_QUALITY_FAST	1
+
 namespace DBOPL {
 
 struct Chip;
 struct Operator;
 struct Channel;
 
-#if (DBOPL_WAVE == WAVE_HANDLER)
 typedef Bits ( DB_FASTCALL *WaveHandler) ( Bitu i, Bitu volume );
-#endif
-
-typedef Bits ( DBOPL::Operator::*VolumeHandler) ( );
-typedef Channel* ( DBOPL::Channel::*SynthHandler) ( Chip* chip, Bit32u samples, Bit32s* output );
 
 //Different synth modes that can generate blocks of data
 typedef enum {
@@ -71,6 +88,13 @@ typedef enum {
 	sm3Percussion,
 } SynthMode;
 
+//Active mask with all 18 channels set
+#define ACTIVE_ALL ( ( 1 << 18 ) - 1 )
+
+//Samples and channels per pass of the grouped channel kernel
+#define GROUP_SAMPLES 64
+#define GROUP_LANES 8
+
 //Shifts for the values contained in chandata variable
 enum {
 	SHIFT_KSLBASE = 16,
@@ -87,6 +111,14 @@ public:
 		MASK_TREMOLO = 0x80,
 	};
 
+	//Derived state a register write left for Update
+	enum {
+		DIRTY_RATES = 0x1,			//ksr, envelope rates and rateZero
+		DIRTY_LEVEL = 0x2,			//totalLevel with ksl
+		DIRTY_FREQUENCY = 0x4,		//freqMul, waveAdd and vibrato
+		DIRTY_WAVE = 0x8,			//waveBase and waveMask
+	};
+
 	typedef enum {
 		OFF,
 		RELEASE,
@@ -95,15 +127,9 @@ public:
 		ATTACK,
 	} State;
 
-	VolumeHandler volHandler;
-
-#if (DBOPL_WAVE == WAVE_HANDLER)
-	WaveHandler waveHandler;	//Routine that generate a wave 
-#else
-	Bit16s* waveBase;
+	const Bit16s* waveBase;		//Start of the wave in the wavetable of the chip's wave mode
 	Bit32u waveMask;
 	Bit32u waveStart;
-#endif
 	Bit32u waveIndex;			//WAVE_BITS shifted counter of the frequency index
 	Bit32u waveAdd;				//The base frequency without vibrato
 	Bit32u waveCurrent;			//waveAdd + vibratao
@@ -114,6 +140,7 @@ public:
 	Bit32s sustainLevel;		//When stopping at sustain level stop here
 	Bit32s totalLevel;			//totalLevel is added to every generated volume
 	Bit32u currentLevel;		//totalLevel + tremolo
+	Bit32u preparedStamp;		//Stamp of the chip at the last Prepare
 	Bit32s volume;				//The currently active volume
 	
 	Bit32u attackAdd;			//Timers for the different states of the envelope
@@ -133,6 +160,10 @@ public:
 	Bit8u vibStrength;
 	//Keep track of the calculated KSR so we can check for changes
 	Bit8u ksr;
+	//Selected waveform, picks the routine for WAVE_HANDLER
+	Bit8u waveForm;
+	//DIRTY_ bits of the derived state that is out of date
+	Bit8u dirty;
 private:
 	void SetState( Bit8u s );
 	void UpdateAttack( const Chip* chip );
@@ -142,6 +173,10 @@ public:
 	void UpdateAttenuation();
 	void UpdateRates( const Chip* chip );
 	void UpdateFrequency( );
+	//Point waveBase at the current waveform in the table of the chip's wave mode
+	void UpdateWaveBase( const Chip* chip );
+	//Recompute the derived state the register writes marked dirty
+	void Update( const Chip* chip );
 
 	void Write20( const Chip* chip, Bit8u val );
 	void Write40( const Chip* chip, Bit8u val );
@@ -150,20 +185,31 @@ public:
 	void WriteE0( const Chip* chip, Bit8u val );
 
 	bool Silent() const;
+	//Without lfo the tremolo and vibrato are known to be off
+	template< bool lfo >
 	void Prepare( const Chip* chip );
 
 	void KeyOn( Bit8u mask);
 	void KeyOff( Bit8u mask);
 
 	template< State state>
-	Bits TemplateVolume( );
+	Bits TemplateVolume( Bitu steps );
 
 	Bit32s RateForward( Bit32u add );
 	Bitu ForwardWave();
-	Bitu ForwardVolume();
-
-	Bits GetSample( Bits modulation );
+	Bitu ForwardVolume( Bitu steps );
+	//Forward the envelope over a run of samples with the same volume, returns its length.
+	//A changing envelope is only stepped every step samples
+	Bitu ForwardSpan( Bitu samples, Bitu step, Bitu& vol );
+
+	template< int wave >
+	Bits GetSample( Bits modulation, Bitu vol );
+	template< int wave >
 	Bits GetWave( Bitu index, Bitu vol );
+	//Forward the envelope and store the volume of every sample for the block templates
+	void VolumeBlock( Bitu samples, Bitu step, Bit16u* vol );
+	//Forward the envelope and store the volume multipliers for the grouped kernel
+	void EnvelopeBlock( Bitu samples, Bitu step, Bit16u* mul, Bitu stride );
 public:
 	Operator();
 };
@@ -173,7 +219,7 @@ struct Channel {
 	inline Operator* Op( Bitu index ) {
 		return &( ( this + (index >> 1) )->op[ index & 1 ]);
 	}
-	SynthHandler synthHandler;
+	Bit8u synthMode;		//SynthMode used to render the block starting at this channel
 	Bit32u chanData;		//Frequency/octave and derived values
 	Bit32s old[2];			//Old data for feedback
 
@@ -185,6 +231,9 @@ struct Channel {
 	Bit8s maskLeft;		//Sign extended values for both channel's panning
 	Bit8s maskRight;
 
+	//Early out for a silent block of count channels, clears them in the active mask
+	Channel* Sleep( Chip* chip, Bitu count );
+
 	//Forward the channel data to the operators of the channel
 	void SetChanData( const Chip* chip, Bit32u data );
 	//Change in the chandata, check for new values and if we have to forward to operators
@@ -195,15 +244,36 @@ struct Channel {
 	void ResetC0( const Chip* chip );
 
 	//call this for the first channel
-	template< bool opl3Mode >
-	void GeneratePercussion( Chip* chip, Bit32s* output );
-
-	//Generate blocks of data in specific modes
-	template<SynthMode mode>
+	//vol points at the volume of the first operator for this sample, the others follow in steps of ENV_BLOCK
+	template< bool opl3Mode, int wave >
+	void GeneratePercussion( Chip* chip, Bit32s* output, const Bit16u* vol );
+
+	//Check the first ops operators starting at this channel for tremolo or vibrato
+	bool LfoEnabled( Bitu ops );
+	//Generate blocks of data in specific modes, lfo can be compiled out when it's not used
+	template<SynthMode mode, bool lfo, int wave>
 	Channel* BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output );
+	//Pick the block template for the wave mode of the chip
+	template<SynthMode mode, bool lfo>
+	Channel* BlockWave( Chip* chip, Bit32u samples, Bit32s* output );
+	//Pick the block template for the current synth mode, returns the next channel
+	Channel* Block( Chip* chip, Bit32u samples, Bit32s* output );
 	Channel();
 };
 
+//Tables that only depend on the sample rate, shared by all the chips running at it
+struct RateTables {
+	Bit32u rate;
+	//Frequency scales for the different multiplications
+	Bit32u freqMul[16];
+	//Rates for decay and release for rate of this chip
+	Bit32u linearRates[76];
+	//Best match attack rates for the rate of this chip
+	Bit32u attackRates[76];
+
+	void Setup( Bit32u rate );
+};
+
 struct Chip {
 	//This is used as the base counter for vibrato and tremolo
 	Bit32u lfoCounter;
@@ -214,12 +284,9 @@ struct Chip {
 	Bit32u noiseAdd;
 	Bit32u noiseValue;
 
-	//Frequency scales for the different multiplications
-	Bit32u freqMul[16];
-	//Rates for decay and release for rate of this chip
-	Bit32u linearRates[76];
-	//Best match attack rates for the rate of this chip
-	Bit32u attackRates[76];
+	//Sample rate and the tables for it
+	Bit32u rate;
+	const RateTables* rates;
 
 	//18 channels with 2 operators each
 	Channel chan[18];
@@ -239,34 +306,124 @@ struct Chip {
 	Bit8u waveFormMask;
 	//0 or -1 when enabled
 	Bit8s opl3Active;
+	//Render the 2 operator channels together in the grouped kernel
+	Bit8u groupChannels;
+	//Wave generator routine, one of the WAVE_ defines
+	Bit8u waveMode;
+	//One of the DBOPL_QUALITY_ defines
+	Bit8u quality;
+	//Samples between envelope steps, more than 1 in the fast quality
+	Bit8u envelopeStep;
+
+	//Bit for every channel that might produce sound, cleared when a channel goes silent
+	//and set again on any write to its registers
+	Bit32u activeMask;
+	//Bit for every channel with operators waiting for an Update
+	Bit32u dirtyMask;
+	//Changes with every register write and lfo value, operators only have to prepare again when it did
+	Bit32u prepareStamp;
 
 	//Return the maximum amount of samples before and LFO change
 	Bit32u ForwardLFO( Bit32u samples );
 	Bit32u ForwardNoise();
 
+	void WakeChannel( Bitu index );
+	//Bring the operators of all dirty channels up to date before generating
+	void UpdateOperators();
 	void WriteBD( Bit8u val );
 	void WriteReg(Bit32u reg, Bit8u val );
 
 	Bit32u WriteAddr( Bit32u port, Bit8u val );
 
+	template< bool opl3Mode, int wave >
+	void GenerateGroup( Channel** group, Bit32s* amMask, Bitu count, Bitu samples, Bit32s* output );
+	//Render the channels the grouped kernel doesn't take and collect the 2 operator ones,
+	//prepared for samples, into group with their AM masks. Returns how many there are
+	template< bool opl3Mode >
+	Bitu CollectGroup( Bitu samples, Bit32s* output, Channel** group, Bit32s* amMask );
+	template< bool opl3Mode >
+	void GenerateChannels( Bitu samples, Bit32s* output );
+
+	//Opl2 mono blocks overwrite the output, opl3 stereo blocks are added to it
 	void GenerateBlock2( Bitu samples, Bit32s* output );
 	void GenerateBlock3( Bitu samples, Bit32s* output );
 
 	void Generate( Bit32u samples );
 	void Setup( Bit32u r );
 
+	//Append the state of the chip field by field, without the pointers and the settings
+	//of the handler, which a restore leaves as they are
+	void SaveState( std::vector< Bit8u >& state ) const;
+	//Bytes SaveState appends
+	static Bitu StateSize();
+	//Take the state back from SaveState, false when it's too short or holds values
+	//out of range, this chip is left alone then
+	bool RestoreState( const Bit8u* state, Bitu size );
+
 	Chip();
 };
 
 struct Handler {
 	DBOPL::Chip chip;
+	//A register write waiting for its sample in the next Generate
+	struct QueuedWrite {
+		Bitu offset;
+		Bit32u addr;
+		Bit8u val;
+	};
+	//Address of a queued entry that only splits the rendering
+	enum { QUEUED_SPLIT = 0xffffffff };
+	//Queued writes in the order they have to happen, offsets never go down
+	std::vector< QueuedWrite > queue;
+	//Threads to split the channels of the chip over, 1 renders them all on the calling thread
+	Bitu channelThreads;
+	//Chip copies and output buffers of the other threads
+	std::vector< Chip > splitChips;
+	std::vector< Bit32s > splitBuffer;
+
 	Bit32u WriteAddr( Bit32u port, Bit8u val );
 	void WriteReg( Bit32u addr, Bit8u val );
-	void Generate( void(*AddSamples_m32)(Bitu,Bit32s*),
-	               void(*AddSamples_s32)(Bitu,Bit32s*),
-	               Bitu samples );
-	void Init( Bitu rate );
+	//Write a register right before the sample at offset in the next Generate call,
+	//offsets lower than the ones already queued are moved up to keep the order
+	void QueueReg( Bitu offset, Bit32u addr, Bit8u val );
+	//Start a new block at offset in the next Generate call without writing anything.
+	//The silent channel early out is taken per block, so rendering in one call split
+	//like this gives the same output as rendering in separate calls of those lengths
+	void QueueSplit( Bitu offset );
+	//Render samples into an interleaved stereo buffer of any length, mono opl2 output
+	//is copied to both sides. With accumulate the samples are added to the buffer.
+	//Queued writes are applied on their sample, writes past the end move to the next call
+	void Generate( Bit32s* output, Bitu samples, bool accumulate );
+	//Render without looking at the queue
+	void GenerateBlock( Bit32s* output, Bitu samples, bool accumulate );
+	//Enable or disable the grouped 2 operator kernel, output is identical either way
+	void SetChannelGroups( bool enable );
+	//Render the channels of this chip on up to threads OpenMP threads, 0 uses all of them
+	//and 1 (the default) none. Only blocks outside of a parallel region are split, so chips
+	//already rendered on a thread each stay there. Output is identical
+	void SetChannelThreads( Bitu threads );
+	//Wave mode selects the wave generator routine, unknown values use DBOPL_WAVE.
+	//DBOPL_QUALITY_FAST steps the envelopes every few samples, reuses the lfo values
+	//while they don't change and always uses the coarse wavetable of WAVE_TABLEFAST
+	void Init( Bitu rate, Bitu waveMode = DBOPL_WAVE, Bitu quality = DBOPL_QUALITY_EXACT );
+	//Append a versioned snapshot of the chip and its queued writes to state
+	void SaveState( std::vector< Bit8u >& state ) const;
+	//Restore a snapshot from SaveState, returns the bytes used or 0 when it's
+	//damaged or from another version, the handler is left alone then
+	Bitu RestoreState( const Bit8u* state, Bitu size );
+
+	Handler();
+private:
+	//GenerateBlock with the channels split over the threads
+	void GenerateSplit( Bit32s* output, Bitu samples, bool accumulate );
 };
 
+//Render samples on count handlers mixed into one interleaved stereo buffer, which is
+//overwritten. The 2 operator channels of the chips in opl3 mode with the exact quality
+//and the multiplication tables share the lanes of the grouped kernel, each chip still
+//takes its queued writes and lfo blocks on its own samples. Output is identical to
+//calling Generate on every handler with accumulate
+void GenerateMulti( Handler** handlers, Bitu count, Bitu samples, Bit32s* output );
+
 
 }		//Namespace
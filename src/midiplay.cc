@@ -35,7 +35,10 @@ static const unsigned NewTimerFreq = 209;
 # include <termios.h>
 # include <fcntl.h>
 # include <sys/ioctl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
 # include <csignal>
+# define SUPPORT_MMAP
 #endif
 
 #include <deque>
@@ -46,13 +49,22 @@ static const unsigned NewTimerFreq = 209;
 #include "fraction"
 
 #ifndef __DJGPP__
+#include <memory>
 #include "dbopl.h"
+#include "oplchip.h"
+#include "cpulevel.h"
 
 #include "adldata.hh"
 
-static const unsigned long PCM_RATE = 48000;
+static unsigned long PCM_RATE = 48000; // Output rate, -rate
 static const unsigned MaxCards = 100;
-static const unsigned MaxSamplesAtTime = 512; // 512=dbopl limitation
+static const unsigned MaxSamplesAtTime = 512; // Longest stretch rendered between event ticks
+static const unsigned MaxSamplesQueued = 16384; // Offline renders collect this many samples of events
+static unsigned WaveMode = DBOPL_WAVE; // DBOPL wave generator routine
+static unsigned Quality = DBOPL_QUALITY_EXACT; // DBOPL quality tier, -fast
+static bool NativeRate = false; // Run the chips at their own rate and resample the mix
+static unsigned long ChipRate = PCM_RATE; // Rate the chips are run at
+static bool FloatOutput = false; // 32-bit float samples to the device and WAV file
 #else // DJGPP
 static const unsigned MaxCards = 1;
 static const unsigned OPLBase = 0x388;
@@ -69,6 +81,10 @@ static bool QuitFlag = false, FakeDOSshell = false;
 static unsigned SkipForward = 0;
 static bool DoingInstrumentTesting = false;
 static bool QuitWithoutLooping = false;
+static bool PrintLengthOnly = false;
+static bool PrintWriteStats = false;
+static double SeekTime = 0.0;
+static double SeekIndexInterval = 0.0;
 static bool WritePCMfile = false;
 static std::string PCMfilepath = "adlmidi.wav";
 #ifdef SUPPORT_VIDEO_OUTPUT
@@ -191,6 +207,24 @@ static const adldata& GetAdlIns(unsigned short insno)
         ? dynamic_instruments[insno & ~DynamicInstrumentTag]
         : adl[insno];
 }
+// Whether insno is an adl[] entry that a bank selects, or a loaded one
+static bool ValidAdlIns(unsigned short insno)
+{
+    if(insno & DynamicInstrumentTag)
+        return (insno & ~DynamicInstrumentTag) < dynamic_instruments.size();
+    static unsigned count = 0;
+    if(!count)
+    {
+        const unsigned NumBanks = sizeof(banknames)/sizeof(*banknames);
+        for(unsigned bankno=0; bankno<NumBanks; ++bankno)
+            for(unsigned a=0; a<256; ++a)
+            {
+                const adlinsdata& ains = adlins[banks[bankno][a]];
+                count = std::max(count, std::max<unsigned>(ains.adlno1, ains.adlno2) + 1u);
+            }
+    }
+    return insno < count;
+}
 
 
 static const char MIDIsymbols[256+1] =
@@ -797,13 +831,16 @@ struct OPL3
     unsigned NumChannels;
 
 #ifndef __DJGPP__
-    std::vector<DBOPL::Handler> cards;
+    std::vector<std::unique_ptr<OPLChip>> cards;
+    unsigned long PokeOffset; // Samples into the next render where pokes take effect
 #endif
 private:
     std::vector<unsigned short> ins; // index to adl[], cached, needed by Touch()
     std::vector<unsigned char> pit;  // value poked to B0, cached, needed by NoteOff)(
     std::vector<unsigned char> regBD;
+    std::vector<short> regs;         // value last poked to each register, -1 = unknown
 public:
+    unsigned long PokesIssued, PokesSuppressed;
     std::vector<char> four_op_category; // 1 = quad-master, 2 = quad-slave, 0 = regular
                                         // 3 = percussion BassDrum
                                         // 4 = percussion Snare
@@ -814,6 +851,13 @@ public:
 
     void Poke(unsigned card, unsigned index, unsigned value)
     {
+        // Rewriting a register with its current value changes nothing,
+        // except for the timer control, whose writes are commands.
+        short& reg = regs[card*512 + index];
+        if(reg == (short)value && index != 0x004)
+            { ++PokesSuppressed; return; }
+        reg = value;
+        ++PokesIssued;
 #ifdef __DJGPP__
         unsigned o = index >> 8;
         unsigned port = OPLBase + o * 2;
@@ -822,9 +866,19 @@ public:
         outportb(port+1, value);
         for(unsigned c=0; c<35; ++c) inportb(port);
 #else
-        cards[card].WriteReg(index, value);
+        cards[card]->QueueReg(PokeOffset, index, value);
 #endif
     }
+#ifndef __DJGPP__
+    // The queued render starts a new block here, where it would have ended
+    // if this tick had been rendered by itself. DBOPL's output depends on
+    // where its blocks start, so this keeps WAV files the same as playback.
+    void SplitRender()
+    {
+        for(unsigned card=0; card<NumCards; ++card)
+            cards[card]->QueueSplit(PokeOffset);
+    }
+#endif
     void NoteOff(unsigned c)
     {
         unsigned card = c/23, cc = c%23;
@@ -974,15 +1028,129 @@ public:
     {
         for(unsigned c=0; c<NumChannels; ++c) { NoteOff(c); Touch_Real(c,0); }
     }
+#ifndef __DJGPP__
+    /* Snapshot of the emulators together with the caches above, for
+     * jumping back to a point in the song without rendering it again.
+     * It only restores into the same number of cards and channels, and
+     * the emulators keep the wave mode and quality they were set up with.
+     */
+    static const unsigned StateVersion = 2;
+    std::vector<unsigned char> SaveState() const
+    {
+        std::vector<unsigned char> state;
+        AppendState(state, (Uint32)StateVersion);
+        AppendState(state, (Uint32)NumCards);
+        AppendState(state, (Uint32)NumChannels);
+        AppendState(state, (Uint32)PokeOffset);
+        for(unsigned c=0; c<NumChannels; ++c)
+        {
+            AppendState(state, ins[c]);
+            AppendState(state, pit[c]);
+            AppendState(state, four_op_category[c]);
+        }
+        for(unsigned card=0; card<NumCards; ++card)
+            AppendState(state, regBD[card]);
+        for(size_t r=0; r<regs.size(); ++r)
+            AppendState(state, regs[r]);
+        for(unsigned card=0; card<NumCards; ++card)
+            cards[card]->SaveState(state);
+        return state;
+    }
+    // False when the state is damaged or doesn't fit, nothing changes then
+    bool RestoreState(const std::vector<unsigned char>& state)
+    {
+        const size_t caches = 4 * sizeof(Uint32)
+                            + NumChannels * (sizeof(ins[0]) + sizeof(pit[0]) + sizeof(four_op_category[0]))
+                            + NumCards * sizeof(regBD[0]) + regs.size() * sizeof(regs[0]);
+        if(state.size() < caches) return false;
+        const unsigned char* data = &state[0];
+        Uint32 version, cards_saved, channels_saved, offset;
+        data = ExtractState(data, version);
+        data = ExtractState(data, cards_saved);
+        data = ExtractState(data, channels_saved);
+        data = ExtractState(data, offset);
+        if(version != StateVersion || cards_saved != NumCards || channels_saved != NumChannels)
+            return false;
+        // Pokes never go past the render ahead and one more stretch
+        if(offset > MaxSamplesQueued + (MaxSamplesAtTime * ChipRate + PCM_RATE - 1) / PCM_RATE)
+            return false;
+        std::vector<unsigned short> new_ins(NumChannels);
+        std::vector<unsigned char> new_pit(NumChannels), new_regBD(NumCards);
+        std::vector<char> new_category(NumChannels);
+        std::vector<short> new_regs(regs.size());
+        for(unsigned c=0; c<NumChannels; ++c)
+        {
+            data = ExtractState(data, new_ins[c]);
+            data = ExtractState(data, new_pit[c]);
+            data = ExtractState(data, new_category[c]);
+            if(!ValidAdlIns(new_ins[c]) || new_category[c] < 0 || new_category[c] > 8)
+                return false;
+        }
+        for(unsigned card=0; card<NumCards; ++card)
+            data = ExtractState(data, new_regBD[card]);
+        for(size_t r=0; r<new_regs.size(); ++r)
+        {
+            data = ExtractState(data, new_regs[r]);
+            if(new_regs[r] < -1 || new_regs[r] > 255) return false;
+        }
+        // Restore into new cards first, so that a bad state changes nothing
+        std::vector<std::unique_ptr<OPLChip>> restored(NumCards);
+        size_t pos = caches;
+        for(unsigned card=0; card<NumCards; ++card)
+        {
+            restored[card].reset(CreateCard());
+            size_t used = restored[card]->RestoreState(&state[pos], state.size() - pos);
+            if(!used) return false;
+            pos += used;
+        }
+        if(pos != state.size()) return false;
+        cards.swap(restored);
+        PokeOffset = offset;
+        ins.swap(new_ins);
+        pit.swap(new_pit);
+        regBD.swap(new_regBD);
+        regs.swap(new_regs);
+        four_op_category.swap(new_category);
+        return true;
+    }
+private:
+    template<typename T>
+    static void AppendState(std::vector<unsigned char>& state, const T& value)
+    {
+        const unsigned char* bytes = (const unsigned char*) &value;
+        state.insert(state.end(), bytes, bytes + sizeof(T));
+    }
+    template<typename T>
+    static const unsigned char* ExtractState(const unsigned char* state, T& value)
+    {
+        std::memcpy(&value, state, sizeof(T));
+        return state + sizeof(T);
+    }
+    OPLChip* CreateCard() const
+    {
+        OPLChipOptions options;
+        options.waveMode = WaveMode;
+        options.quality  = Quality;
+        // A single card can't spread over the threads by itself, so split its channels
+        options.channelThreads = NumCards == 1 ? 0 : 1;
+        OPLChip* chip = CreateOPLChip("dbopl", options);
+        chip->Reset(ChipRate);
+        return chip;
+    }
+public:
+#endif
     void Reset()
     {
 #ifndef __DJGPP__
         cards.resize(NumCards);
+        PokeOffset = 0;
 #endif
         NumChannels = NumCards * 23;
         ins.resize(NumChannels,     189);
         pit.resize(NumChannels,       0);
         regBD.resize(NumCards);
+        regs.assign(NumCards*512, -1);
+        PokesIssued = PokesSuppressed = 0;
         four_op_category.resize(NumChannels);
         for(unsigned p=0, a=0; a<NumCards; ++a)
         {
@@ -999,7 +1167,7 @@ public:
         for(unsigned card=0; card<NumCards; ++card)
         {
 #ifndef __DJGPP__
-            cards[card].Init(PCM_RATE);
+            cards[card].reset(CreateCard());
 #endif
             for(unsigned a=0; a< 18; ++a) Poke(card, 0xB0+Channels[a], 0x00);
             for(unsigned a=0; a< sizeof(data)/sizeof(*data); a+=2)
@@ -1079,28 +1247,109 @@ public:
     }
 };
 
+/* The contents of a file, mapped into memory where mmap is available
+ * and read into a buffer elsewhere or when the file can't be mapped.
+ */
+class MappedFile
+{
+    const unsigned char* data;
+    size_t size;
+    void* mapping;
+    std::vector<unsigned char> buffer;
+
+    MappedFile(const MappedFile&);
+    void operator=(const MappedFile&);
+public:
+    MappedFile() : data(0), size(0), mapping(0) { }
+    ~MappedFile()
+    {
+    #ifdef SUPPORT_MMAP
+        if(mapping) munmap(mapping, size);
+    #endif
+    }
+    bool Open(const char* filename)
+    {
+    #ifdef SUPPORT_MMAP
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED)
+            {
+                close(fd);
+                mapping = p;
+                data = (const unsigned char*) p;
+                size = st.st_size;
+                return true;
+            }
+        }
+        close(fd);
+    #endif
+        // Pipes and the like are read to the end
+        std::FILE* fp = std::fopen(filename, "rb");
+        if(!fp) return false;
+        unsigned char chunk[4096];
+        for(size_t n; (n = std::fread(chunk, 1, sizeof(chunk), fp)) > 0; )
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        std::fclose(fp);
+        data = buffer.empty() ? 0 : &buffer[0];
+        size = buffer.size();
+        return true;
+    }
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+};
+
 class MIDIplay
 {
-    // Information about each track
+    // The tracks are compiled at load time into a single list of events in
+    // playing order, one array per field, with the running status resolved
+    // and the meta events decoded. The events go in rows: a row holds the
+    // next due event of every track, and is handled by one ProcessEvents.
+    enum { Ev_Ignore,    // Ends a track or does nothing, but takes its place
+           Ev_SysEx,     // a = F0 or F7, value = length
+           Ev_Tempo,     // value = microseconds per beat
+           Ev_LoopStart,
+           Ev_LoopEnd,
+           Ev_Text,      // a = meta event type, value = offset in text
+           Ev_Device,    // value = offset of the port name in text
+           Ev_Poke,      // a = OPL register, b = value
+           Ev_Channel = 0x80 }; // From here on the status byte of a channel event
+    struct EventList
+    {
+        std::vector<unsigned char>  kind;     // Ev_* or the status byte
+        std::vector<unsigned char>  a, b;     // Decoded parameters
+        std::vector<unsigned short> track;
+        std::vector<unsigned>       value;
+        std::vector<char>           text;     // Meta event data, each one ends in a nul
+        std::vector<unsigned>       rowBegin; // First event of each row, then the end
+        std::vector<unsigned long>  rowTick;  // Time of each row in ticks
+    } Events;
+
+    // Where the playback is
     struct Position
     {
         bool began;
         double wait;
-        struct TrackInfo
-        {
-            size_t ptr;
-            long   delay;
-            int    status;
-
-            TrackInfo(): ptr(0), delay(0), status(0) { }
-        };
-        std::vector<TrackInfo> track;
+        size_t row;
 
-        Position(): began(false), wait(0.0), track() { }
+        Position(): began(false), wait(0.0), row(0) { }
     } CurrentPosition, LoopBeginPosition;
 
+    // The tempo changes, so that any tick can be turned into a time
+    // without playing the song up to it
+    struct TempoSegment
+    {
+        unsigned long tick;       // Where this tempo begins
+        double        time;       // Seconds from the start of the song there
+        double        tickLength; // Seconds per tick
+    };
+    std::vector<TempoSegment> TempoMap;
+
     std::map<std::string, unsigned> devices;
-    std::map<unsigned/*track*/, unsigned/*channel begin index*/> current_device;
+    std::vector<unsigned/*channel begin index*/> current_device; // By track
 
     // Persistent settings for each MIDI channel
     struct MIDIchannel
@@ -1124,14 +1373,43 @@ class MIDIplay
             unsigned char midiins;
             // Index to physical adlib data structure, adlins[]
             unsigned short insmeta;
-            // List of adlib channels it is currently occupying.
-            std::map<unsigned short/*adlchn*/,
-                     unsigned short/*ins, inde to adl[]*/
-                    > phys;
+            // List of adlib channels it is currently occupying, at most
+            // two, in the order of the channel
+            struct Phys
+            {
+                unsigned short adlchn;
+                unsigned short ins; // index to adl[]
+            };
+            Phys phys[2];
+            unsigned char nphys;
+
+            void SetPhys(unsigned adlchn, unsigned ins)
+            {
+                unsigned p = 0;
+                while(p < nphys && phys[p].adlchn < adlchn) ++p;
+                if(p == nphys || phys[p].adlchn != adlchn)
+                {
+                    if(p == 0 && nphys) phys[1] = phys[0];
+                    phys[p].adlchn = adlchn;
+                    ++nphys;
+                }
+                phys[p].ins = ins;
+            }
+            void ErasePhys(unsigned adlchn)
+            {
+                for(unsigned p = 0; p < nphys; ++p)
+                    if(phys[p].adlchn == adlchn)
+                    {
+                        if(p == 0) phys[0] = phys[1];
+                        --nphys;
+                        return;
+                    }
+            }
         };
-        typedef std::map<unsigned char,NoteInfo> activenotemap_t;
-        typedef activenotemap_t::iterator activenoteiterator;
-        activenotemap_t activenotes;
+        // The notes that sound, by key. A note is active as long as it
+        // occupies a channel.
+        NoteInfo activenotes[128];
+        unsigned char nactive;
 
         MIDIchannel()
             : portamento(0),
@@ -1141,8 +1419,16 @@ class MIDIplay
               bend(0.0), bendsense(2 / 8192.0),
               vibpos(0), vibspeed(2*3.141592653*5.0),
               vibdepth(0.5/127), vibdelay(0),
-              lastlrpn(0),lastmrpn(0),nrpn(false),
-              activenotes() { }
+              lastlrpn(0),lastmrpn(0),nrpn(false)
+            { ClearNotes(); }
+
+        bool NoteActive(unsigned note) const
+            { return activenotes[note].nphys != 0; }
+        void ClearNotes()
+        {
+            for(unsigned n = 0; n < 128; ++n) activenotes[n].nphys = 0;
+            nactive = 0;
+        }
     };
     std::vector<MIDIchannel> Ch;
     bool cmf_percussion_mode = false;
@@ -1167,37 +1453,65 @@ class MIDIplay
             long kon_time_until_neglible;
             long vibdelay;
         };
-        typedef std::map<Location, LocationData> users_t;
-        users_t users;
+        // The notes on the channel, in the order of their Location, are
+        // kept in a list through UserPool
+        struct User
+        {
+            Location     loc;
+            LocationData data;
+            unsigned     next;
+        };
+        enum { NoUser = ~0u };
+        unsigned users, n_users;
 
         // If the channel is keyoff'd
         long koff_time_until_neglible;
         // For channel allocation:
-        AdlChannel(): users(), koff_time_until_neglible(0) { }
+        AdlChannel(): users(NoUser), n_users(0), koff_time_until_neglible(0) { }
 
-        void AddAge(long ms)
+        void AddAge(long ms, std::vector<User>& pool)
         {
-            if(users.empty())
+            if(users == NoUser)
                 koff_time_until_neglible =
                     std::max(koff_time_until_neglible-ms, -0x1FFFFFFFl);
             else
             {
                 koff_time_until_neglible = 0;
-                for(users_t::iterator i = users.begin(); i != users.end(); ++i)
+                for(unsigned i = users; i != NoUser; i = pool[i].next)
                 {
-                    i->second.kon_time_until_neglible =
-                    std::max(i->second.kon_time_until_neglible-ms, -0x1FFFFFFFl);
-                    i->second.vibdelay += ms;
+                    pool[i].data.kon_time_until_neglible =
+                    std::max(pool[i].data.kon_time_until_neglible-ms, -0x1FFFFFFFl);
+                    pool[i].data.vibdelay += ms;
                 }
             }
         }
     };
     std::vector<AdlChannel> ch;
-
-    std::vector< std::vector<unsigned char> > TrackData;
+    // The users of all channels, the unused ones are linked from FreeUser
+    std::vector<AdlChannel::User> UserPool;
+    unsigned FreeUser = AdlChannel::NoUser;
+
+    // Seeking replays the sequencer state up to the target without making
+    // a sound, then keys on the notes that would be sounding there. Those
+    // are kept by MIDI channel and key as Note_* with the volume.
+    enum { Note_Held = 0x100, Note_Sustained = 0x200 };
+    struct SeekPoint
+    {
+        size_t         row;
+        bool           began, loopStart;
+        Position       loopBegin;
+        fraction<long> tempo;
+        bool           cmf_percussion_mode;
+        std::vector<MIDIchannel>    channels;
+        std::vector<unsigned>       devices;
+        std::vector<unsigned short> notes;
+    };
+    std::vector<SeekPoint> SeekIndex; // By row, the first one is the start of the song
 public:
     fraction<long> InvDeltaTicks, Tempo;
     bool loopStart, loopEnd;
+    // Known right after LoadMIDI, in seconds from the start of the song
+    double SongLength, LoopStartTime, LoopEndTime;
     OPL3 opl;
 public:
     static unsigned long ReadBEint(const void* buffer, unsigned nbytes)
@@ -1216,12 +1530,12 @@ public:
             result = result + (data[n] << (n*8));
         return result;
     }
-    unsigned long ReadVarLen(unsigned tk)
+    static unsigned long ReadVarLen(const unsigned char* data, size_t size, size_t& ptr)
     {
         unsigned long result = 0;
-        for(;;)
+        while(ptr < size)
         {
-            unsigned char byte = TrackData[tk][CurrentPosition.track[tk].ptr++];
+            unsigned char byte = data[ptr++];
             result = (result << 7) + (byte & 0x7F);
             if(!(byte & 0x80)) break;
         }
@@ -1230,14 +1544,40 @@ public:
 
     bool LoadMIDI(const std::string& filename)
     {
-        std::FILE* fp = std::fopen(filename.c_str(), "rb");
-        if(!fp) { std::fprintf(stderr, "\n"); std::perror(filename.c_str()); return false; }
+        MappedFile file;
+        if(!file.Open(filename.c_str()))
+            { std::fprintf(stderr, "\n"); std::perror(filename.c_str()); return false; }
+        return LoadMIDI(file.Data(), file.Size(), filename);
+    }
+
+    // Loads a song from memory. The data is only read during the call,
+    // name is used in the messages.
+    bool LoadMIDI(const unsigned char* data, size_t size, const std::string& name)
+    {
+        // Reads past the end give -1, like fgetc does at the end of a file
+        auto Byte = [data, size](size_t pos) -> int
+            { return pos < size ? data[pos] : -1; };
+        // The part of the data from pos on, at most length bytes long
+        auto Span = [data, size](size_t pos, size_t length) -> TrackSpan
+        {
+            if(pos > size) pos = size;
+            TrackSpan span = { data + pos, std::min(length, size - pos) };
+            return span;
+        };
+
         const unsigned HeaderSize = 4+4+2+2+2; // 14
-        char HeaderBuf[HeaderSize]="";
-    riffskip:;
-        std::fread(HeaderBuf, 1, HeaderSize, fp);
-        if(std::memcmp(HeaderBuf, "RIFF", 4) == 0)
-            { std::fseek(fp, 6, SEEK_CUR); goto riffskip; }
+        unsigned char HeaderBuf[HeaderSize]="";
+        size_t pos = 0;
+        for(;;)
+        {
+            // A short file reads as zeros past its end
+            std::memset(HeaderBuf, 0, HeaderSize);
+            for(unsigned n = 0; n < HeaderSize && pos + n < size; ++n)
+                HeaderBuf[n] = data[pos + n];
+            pos += HeaderSize;
+            if(std::memcmp(HeaderBuf, "RIFF", 4) != 0) break;
+            pos += 6;
+        }
         size_t DeltaTicks=192, TrackCount=1;
 
         bool is_GMF = false; // GMD/MUS files (ScummVM)
@@ -1245,12 +1585,11 @@ public:
         bool is_IMF = false; // IMF
         bool is_CMF = false; // Creative Music format (CMF/CTMF)
         bool is_RSXX = false; // RSXX, such as Cartooners
-        std::vector<unsigned char> MUS_instrumentList;
 
         if(std::memcmp(HeaderBuf, "GMF\1", 4) == 0)
         {
             // GMD/MUS files (ScummVM)
-            std::fseek(fp, 7-(HeaderSize), SEEK_CUR);
+            pos = pos - HeaderSize + 7;
             is_GMF = true;
         }
         else if(std::memcmp(HeaderBuf, "MUS\1x1A", 4) == 0)
@@ -1258,7 +1597,7 @@ public:
             // MUS/DMX files (Doom)
             unsigned start = ReadLEint(HeaderBuf+8, 2);
             is_MUS = true;
-            std::fseek(fp, int(start-HeaderSize), SEEK_CUR);
+            pos = pos - HeaderSize + start;
         }
         else if(std::memcmp(HeaderBuf, "CTMF", 4) == 0)
         {
@@ -1273,18 +1612,16 @@ public:
             unsigned mus_start = ReadLEint(HeaderBuf+8, 2);
             //unsigned deltas    = ReadLEint(HeaderBuf+10, 2);
             unsigned ticks     = ReadLEint(HeaderBuf+12, 2);
-            // Read title, author, remarks start offsets in file
-            std::fread(HeaderBuf, 1, 6, fp);
-            //unsigned long notes_starts[3] = {ReadLEint(HeaderBuf+0,2),ReadLEint(HeaderBuf+0,4),ReadLEint(HeaderBuf+0,6)};
-            std::fseek(fp, 16, SEEK_CUR); // Skip the channels-in-use table
-            std::fread(HeaderBuf, 1, 4, fp);
-            unsigned ins_count =  ReadLEint(HeaderBuf+0, 2);//, basictempo = ReadLEint(HeaderBuf+2, 2);
-            std::fseek(fp, ins_start, SEEK_SET);
+            // Then come the title, author and remarks offsets in the file
+            // and the channels-in-use table
+            //unsigned long notes_starts[3] = {ReadLEint(data+pos,2),ReadLEint(data+pos+2,2),ReadLEint(data+pos+4,2)};
+            if(pos + 6 + 16 + 4 > size) goto InvFmt;
+            unsigned ins_count = ReadLEint(data + pos + 6 + 16, 2);//, basictempo = ReadLEint(data+pos+6+16+2, 2);
+            if(ins_start > size || ins_count > (size - ins_start) / 16) goto InvFmt;
             //std::printf("%u instruments\n", ins_count);
             for(unsigned i=0; i<ins_count; ++i)
             {
-                unsigned char InsData[16];
-                std::fread(InsData, 1, 16, fp);
+                const unsigned char* InsData = data + ins_start + i*16;
                 /*std::printf("Ins %3u: %02X %02X %02X %02X  %02X %02X %02X %02X  %02X %02X %02X %02X  %02X %02X %02X %02X\n",
                     i, InsData[0],InsData[1],InsData[2],InsData[3], InsData[4],InsData[5],InsData[6],InsData[7],
                        InsData[8],InsData[9],InsData[10],InsData[11], InsData[12],InsData[13],InsData[14],InsData[15]);*/
@@ -1314,7 +1651,7 @@ public:
                 dynamic_metainstruments.push_back(adlins);
                 dynamic_instruments.push_back(adl);
             }
-            std::fseek(fp, mus_start, SEEK_SET);
+            pos = mus_start;
             TrackCount = 1;
             DeltaTicks = ticks;
             AdlBank    = ~0u; // Ignore AdlBank number, use dynamic banks instead
@@ -1324,16 +1661,12 @@ public:
         else
         {
             // Try parsing as EA RSXX file
-            char rsxxbuf[8];
-            {long p = std::ftell(fp);
-            std::fseek(fp, HeaderBuf[0]-0x10, SEEK_SET);
-            std::fread(rsxxbuf, 6, 1, fp);
-            std::fseek(fp, p, SEEK_SET);}
-            if(std::memcmp(rsxxbuf, "rsxx}u", 6) == 0)
+            if(HeaderBuf[0] >= 0x10 && HeaderBuf[0] - 0x10 + 6u <= size
+            && std::memcmp(data + HeaderBuf[0] - 0x10, "rsxx}u", 6) == 0)
             {
                 is_RSXX = true;
                 std::fprintf(stderr, "Detected RSXX format\n");
-                std::fseek(fp, HeaderBuf[0], SEEK_SET);
+                pos = HeaderBuf[0];
                 TrackCount = 1;
                 DeltaTicks = 60;
                 LogarithmicVolumes = true;
@@ -1344,18 +1677,16 @@ public:
                 // Try parsing as an IMF file
                 if(1)
                 {
-                    unsigned end = (unsigned char)HeaderBuf[0] + 256*(unsigned char)HeaderBuf[1];
+                    unsigned end = HeaderBuf[0] + 256*HeaderBuf[1];
                     if(!end || (end & 3)) goto not_imf;
 
-                    long backup_pos = std::ftell(fp);
                     unsigned sum1 = 0, sum2 = 0;
-                    std::fseek(fp, 2, SEEK_SET);
                     for(unsigned n=0; n<42; ++n)
                     {
-                        unsigned value1 = std::fgetc(fp); value1 += std::fgetc(fp) << 8; sum1 += value1;
-                        unsigned value2 = std::fgetc(fp); value2 += std::fgetc(fp) << 8; sum2 += value2;
+                        size_t p = 2 + n*4;
+                        unsigned value1 = Byte(p+0); value1 += unsigned(Byte(p+1)) << 8; sum1 += value1;
+                        unsigned value2 = Byte(p+2); value2 += unsigned(Byte(p+3)) << 8; sum2 += value2;
                     }
-                    std::fseek(fp, backup_pos, SEEK_SET);
                     if(sum1 > sum2)
                     {
                         is_IMF = true;
@@ -1368,8 +1699,7 @@ public:
                 not_imf:
                     if(std::memcmp(HeaderBuf, "MThd\0\0\0\6", 8) != 0)
                     { InvFmt:
-                        std::fclose(fp);
-                        std::fprintf(stderr, "%s: Invalid format\n", filename.c_str());
+                        std::fprintf(stderr, "%s: Invalid format\n", name.c_str());
                         return false;
                     }
                     /*size_t  Fmt =*/ ReadBEint(HeaderBuf+8,  2);
@@ -1378,22 +1708,21 @@ public:
                 }
             }
         }
-        TrackData.resize(TrackCount);
-        CurrentPosition.track.resize(TrackCount);
+        std::vector<TrackSpan> Tracks(TrackCount);
         InvDeltaTicks = fraction<long>(1, 1000000l * DeltaTicks);
         //Tempo       = 1000000l * InvDeltaTicks;
         Tempo         = fraction<long>(1,            DeltaTicks);
 
-        static const unsigned char EndTag[4] = {0xFF,0x2F,0x00,0x00};
+        // IMF is the one format that is converted into a track of its own
+        std::vector<unsigned char> IMFTrack;
 
         for(size_t tk = 0; tk < TrackCount; ++tk)
         {
-            // Read track header
-            size_t TrackLength;
+            // Find the track data
             if(is_IMF)
             {
                 //std::fprintf(stderr, "Reading IMF file...\n");
-                long end = (unsigned char)HeaderBuf[0] + 256*(unsigned char)HeaderBuf[1];
+                size_t end = std::min(size_t(HeaderBuf[0] + 256*HeaderBuf[1]), size);
 
                 unsigned IMF_tempo = 1428;
                 static const unsigned char imf_tempo[] = {0xFF,0x51,0x4,
@@ -1401,75 +1730,65 @@ public:
                     (unsigned char)(IMF_tempo>>16),
                     (unsigned char)(IMF_tempo>>8),
                     (unsigned char)(IMF_tempo)};
-                TrackData[tk].insert(TrackData[tk].end(), imf_tempo, imf_tempo + sizeof(imf_tempo));
-                TrackData[tk].push_back(0x00);
+                static const unsigned char EndTag[4] = {0xFF,0x2F,0x00,0x00};
+                IMFTrack.insert(IMFTrack.end(), imf_tempo, imf_tempo + sizeof(imf_tempo));
+                IMFTrack.push_back(0x00);
 
-                std::fseek(fp, 2, SEEK_SET);
-                while(std::ftell(fp) < end)
+                for(size_t p = 2; p < end; p += 4)
                 {
                     unsigned char special_event_buf[5];
                     special_event_buf[0] = 0xFF;
                     special_event_buf[1] = 0xE3;
                     special_event_buf[2] = 0x02;
-                    special_event_buf[3] = std::fgetc(fp); // port index
-                    special_event_buf[4] = std::fgetc(fp); // port value
-                    unsigned delay = std::fgetc(fp); delay += 256 * std::fgetc(fp);
+                    special_event_buf[3] = Byte(p+0); // port index
+                    special_event_buf[4] = Byte(p+1); // port value
+                    unsigned delay = Byte(p+2); delay += 256 * Byte(p+3);
 
                     //if(special_event_buf[3] <= 8) continue;
 
                     //fprintf(stderr, "Put %02X <- %02X, plus %04X delay\n", special_event_buf[3],special_event_buf[4], delay);
 
-                    TrackData[tk].insert(TrackData[tk].end(), special_event_buf, special_event_buf+5);
-                    //if(delay>>21) TrackData[tk].push_back( 0x80 | ((delay>>21) & 0x7F ) );
-                    if(delay>>14) TrackData[tk].push_back( 0x80 | ((delay>>14) & 0x7F ) );
-                    if(delay>> 7) TrackData[tk].push_back( 0x80 | ((delay>> 7) & 0x7F ) );
-                    TrackData[tk].push_back( ((delay>>0) & 0x7F ) );
+                    IMFTrack.insert(IMFTrack.end(), special_event_buf, special_event_buf+5);
+                    //if(delay>>21) IMFTrack.push_back( 0x80 | ((delay>>21) & 0x7F ) );
+                    if(delay>>14) IMFTrack.push_back( 0x80 | ((delay>>14) & 0x7F ) );
+                    if(delay>> 7) IMFTrack.push_back( 0x80 | ((delay>> 7) & 0x7F ) );
+                    IMFTrack.push_back( ((delay>>0) & 0x7F ) );
                 }
-                TrackData[tk].insert(TrackData[tk].end(), EndTag+0, EndTag+4);
-                CurrentPosition.track[tk].delay = 0;
+                IMFTrack.insert(IMFTrack.end(), EndTag+0, EndTag+4);
+                Tracks[tk].data = &IMFTrack[0];
+                Tracks[tk].size = IMFTrack.size();
                 CurrentPosition.began = true;
                 //std::fprintf(stderr, "Done reading IMF file\n");
             }
-            else
+            else if(is_GMF || is_CMF || is_RSXX) // Take the rest of the file
             {
-                if(is_GMF || is_CMF || is_RSXX) // Take the rest of the file
-                {
-                    long pos = std::ftell(fp);
-                    std::fseek(fp, 0, SEEK_END);
-                    TrackLength = ftell(fp) - pos;
-                    std::fseek(fp, pos, SEEK_SET);
-                }
-                else if(is_MUS) // Read TrackLength from file position 4
-                {
-                    long pos = std::ftell(fp);
-                    std::fseek(fp, 4, SEEK_SET);
-                    TrackLength = std::fgetc(fp); TrackLength += (std::fgetc(fp) << 8);
-                    std::fseek(fp, pos, SEEK_SET);
-                }
-                else // Read MTrk header
-                {
-                    std::fread(HeaderBuf, 1, 8, fp);
-                    if(std::memcmp(HeaderBuf, "MTrk", 4) != 0) goto InvFmt;
-                    TrackLength = ReadBEint(HeaderBuf+4, 4);
-                }
-                // Read track data
-                TrackData[tk].resize(TrackLength);
-                std::fread(&TrackData[tk][0], 1, TrackLength, fp);
-                if(is_GMF || is_MUS) // Note: CMF does include the track end tag.
-                {
-                    TrackData[tk].insert(TrackData[tk].end(), EndTag+0, EndTag+4);
-                }
-                // Read next event time
-                if(!is_RSXX)
-                    CurrentPosition.track[tk].delay = ReadVarLen(tk);
+                Tracks[tk] = Span(pos, size);
+            }
+            else if(is_MUS) // Read TrackLength from file position 4
+            {
+                if(size < 6) goto InvFmt;
+                Tracks[tk] = Span(pos, ReadLEint(data+4, 2));
+            }
+            else // Read MTrk header
+            {
+                if(pos + 8 > size || std::memcmp(data + pos, "MTrk", 4) != 0) goto InvFmt;
+                size_t TrackLength = ReadBEint(data + pos + 4, 4);
+                Tracks[tk] = Span(pos + 8, TrackLength);
+                pos += 8 + Tracks[tk].size;
             }
         }
+        // IMF and RSXX tracks begin with an event, the others with a delay.
+        // GMF and MUS tracks have no end event, CMF does include one.
+        CompileEvents(Tracks, !is_IMF && !is_RSXX, is_GMF || is_MUS);
+        BuildTempoMap();
+        current_device.assign(TrackCount, 0);
         loopStart = true;
+        SeekIndex.assign(1, SeekPoint());
+        SaveSeekPoint(SeekIndex[0], 0, CurrentPosition.began, std::vector<unsigned short>());
 
         opl.Reset(); // Reset AdLib
         //opl.Reset(); // ...twice (just in case someone misprogrammed OPL3 previously)
-        ch.clear();
-        ch.resize(opl.NumChannels);
+        ResetChannels();
         return true;
     }
 
@@ -1488,13 +1807,111 @@ public:
         }
 
         for(unsigned c = 0; c < opl.NumChannels; ++c)
-            ch[c].AddAge(s * 1000);
+            ch[c].AddAge(s * 1000, UserPool);
 
         UpdateVibrato(s);
         UpdateArpeggio(s);
         return CurrentPosition.wait;
     }
 
+    // Time of a tick in seconds, from the start of the song
+    double TickToTime(unsigned long tick) const
+    {
+        // The last segment that begins at or before the tick
+        size_t lo = 0, hi = TempoMap.size();
+        while(hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(TempoMap[mid].tick <= tick) lo = mid; else hi = mid;
+        }
+        const TempoSegment& seg = TempoMap[lo];
+        return seg.time + (tick - seg.tick) * seg.tickLength;
+    }
+    unsigned long TickToSample(unsigned long tick, unsigned long rate) const
+    {
+        return (unsigned long)(TickToTime(tick) * rate + 0.5);
+    }
+    // The first tick at or after a time in seconds
+    unsigned long TimeToTick(double time) const
+    {
+        size_t lo = 0, hi = TempoMap.size();
+        while(hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(TempoMap[mid].time <= time) lo = mid; else hi = mid;
+        }
+        const TempoSegment& seg = TempoMap[lo];
+        if(time <= seg.time || seg.tickLength <= 0.0) return seg.tick;
+        return seg.tick + (unsigned long)std::ceil((time - seg.time) / seg.tickLength - 1e-9);
+    }
+
+    // Continues playing from a time in seconds, or from the end of the
+    // song if it is shorter. Only the sequencer state is replayed up to
+    // there, from the last entry of the seek index before it.
+    void Seek(double time)
+    {
+        const size_t rows = Events.rowTick.size();
+        size_t target = std::lower_bound(Events.rowTick.begin(), Events.rowTick.end(),
+                                         TimeToTick(time)) - Events.rowTick.begin();
+        if(target >= rows) target = rows - 1;
+
+        size_t point = SeekIndex.size() - 1;
+        while(SeekIndex[point].row > target) --point;
+
+        // Nothing may sound while replaying, HandleEvent then only sets state
+        for(unsigned MidCh = 0; MidCh < Ch.size(); ++MidCh)
+        {
+            Ch[MidCh].sustain = 0;
+            NoteUpdate_All(MidCh, Upd_Off);
+        }
+        opl.Silence();
+        ResetChannels();
+
+        std::vector<unsigned short> notes;
+        bool began;
+        LoadSeekPoint(SeekIndex[point], notes, began);
+        for(size_t row = SeekIndex[point].row; row < target; ++row)
+            ReplayRow(row, notes, began);
+
+        // Notes released during a sustain are keyed off again while it holds
+        for(size_t n = 0; n < notes.size(); ++n)
+            if(notes[n])
+            {
+                NoteOn(n / 128, n % 128, notes[n] & 0xFF);
+                if(notes[n] & Note_Sustained) NoteOff(n / 128, n % 128);
+            }
+
+        CurrentPosition.began = began;
+        CurrentPosition.row   = target;
+        CurrentPosition.wait  = began ? std::max(0.0, TickToTime(Events.rowTick[target]) - time) : 0.0;
+    }
+
+    // Keeps a copy of the sequencer state about every interval seconds, so
+    // that Seek only replays what comes after the copy before the target.
+    // Call it before playing: it replays the song from the start.
+    void BuildSeekIndex(double interval)
+    {
+        SeekIndex.resize(1);
+        // IMF songs are nothing but register writes, they replay from the start
+        if(std::count(Events.kind.begin(), Events.kind.end(), (unsigned char)Ev_Poke))
+            return;
+        std::vector<unsigned short> notes;
+        bool began;
+        LoadSeekPoint(SeekIndex[0], notes, began);
+        double next = interval;
+        for(size_t row = 0; row < Events.rowTick.size(); ++row)
+        {
+            if(TickToTime(Events.rowTick[row]) >= next)
+            {
+                SeekIndex.push_back(SeekPoint());
+                SaveSeekPoint(SeekIndex.back(), row, began, notes);
+                next += interval;
+            }
+            ReplayRow(row, notes, began);
+        }
+        LoadSeekPoint(SeekIndex[0], notes, began);
+    }
+
 private:
     enum { Upd_Patch  = 0x1,
            Upd_Pan    = 0x2,
@@ -1503,13 +1920,74 @@ private:
            Upd_All    = Upd_Pan + Upd_Volume + Upd_Pitch,
            Upd_Off    = 0x20 };
 
+    void ResetChannels()
+    {
+        ch.clear();
+        ch.resize(opl.NumChannels);
+        UserPool.clear();
+        FreeUser = AdlChannel::NoUser;
+    }
+
+    // The user of channel c at loc, or NoUser
+    unsigned FindUser(unsigned c, const AdlChannel::Location& loc) const
+    {
+        unsigned u = ch[c].users;
+        while(u != AdlChannel::NoUser && UserPool[u].loc < loc) u = UserPool[u].next;
+        if(u != AdlChannel::NoUser && UserPool[u].loc == loc) return u;
+        return AdlChannel::NoUser;
+    }
+    // Puts user u in its place in the list of channel c, which must not
+    // have one at the same location
+    void LinkUser(unsigned c, unsigned u)
+    {
+        unsigned prev = AdlChannel::NoUser, next = ch[c].users;
+        while(next != AdlChannel::NoUser && UserPool[next].loc < UserPool[u].loc)
+            { prev = next; next = UserPool[next].next; }
+        UserPool[u].next = next;
+        if(prev == AdlChannel::NoUser) ch[c].users = u; else UserPool[prev].next = u;
+        ++ch[c].n_users;
+    }
+    void UnlinkUser(unsigned c, unsigned u)
+    {
+        unsigned* link = &ch[c].users;
+        while(*link != u) link = &UserPool[*link].next;
+        *link = UserPool[u].next;
+        --ch[c].n_users;
+    }
+    void EraseUser(unsigned c, unsigned u)
+    {
+        UnlinkUser(c, u);
+        UserPool[u].next = FreeUser;
+        FreeUser = u;
+    }
+    // The user of channel c at loc, a new one starts out zeroed
+    AdlChannel::LocationData& UserData(unsigned c, const AdlChannel::Location& loc)
+    {
+        unsigned u = FindUser(c, loc);
+        if(u == AdlChannel::NoUser)
+        {
+            u = FreeUser;
+            if(u != AdlChannel::NoUser)
+                FreeUser = UserPool[u].next;
+            else
+            {
+                u = UserPool.size();
+                UserPool.push_back(AdlChannel::User());
+            }
+            UserPool[u].loc  = loc;
+            UserPool[u].data = AdlChannel::LocationData();
+            LinkUser(c, u);
+        }
+        return UserPool[u].data;
+    }
+
     void NoteUpdate
         (unsigned MidCh,
-         MIDIchannel::activenoteiterator i,
+         unsigned note,
          unsigned props_mask,
          int select_adlchn = -1)
     {
-        MIDIchannel::NoteInfo& info = i->second;
+        MIDIchannel::NoteInfo& info = Ch[MidCh].activenotes[note];
         const int tone    = info.tone;
         const int vol     = info.vol;
         const int midiins = info.midiins;
@@ -1518,42 +1996,44 @@ private:
 
         AdlChannel::Location my_loc;
         my_loc.MidCh = MidCh;
-        my_loc.note  = i->first;
+        my_loc.note  = note;
 
-        for(auto jnext = info.phys.begin(); jnext != info.phys.end(); )
+        // A copy, the note off takes the channels out of the note
+        const unsigned nphys = info.nphys;
+        const MIDIchannel::NoteInfo::Phys phys[2] = { info.phys[0], info.phys[1] };
+
+        for(unsigned p = 0; p < nphys; ++p)
         {
-            auto j = jnext++;
-            int c   = j->first;
-            int ins = j->second;
+            int c   = phys[p].adlchn;
+            int ins = phys[p].ins;
             if(select_adlchn >= 0 && c != select_adlchn) continue;
 
             if(props_mask & Upd_Patch)
             {
                 opl.Patch(c, ins);
-                AdlChannel::LocationData& d = ch[c].users[my_loc];
+                AdlChannel::LocationData& d = UserData(c, my_loc);
                 d.sustained = false; // inserts if necessary
                 d.vibdelay  = 0;
                 d.kon_time_until_neglible = ains.ms_sound_kon;
                 d.ins       = ins;
             }
         }
-        for(auto jnext = info.phys.begin(); jnext != info.phys.end(); )
+        for(unsigned p = 0; p < nphys; ++p)
         {
-            auto j = jnext++;
-            int c   = j->first;
-            int ins = j->second;
+            int c   = phys[p].adlchn;
+            int ins = phys[p].ins;
             if(select_adlchn >= 0 && c != select_adlchn) continue;
 
             if(props_mask & Upd_Off) // note off
             {
                 if(Ch[MidCh].sustain == 0)
                 {
-                    AdlChannel::users_t::iterator k = ch[c].users.find(my_loc);
-                    if(k != ch[c].users.end())
-                        ch[c].users.erase(k);
+                    unsigned k = FindUser(c, my_loc);
+                    if(k != AdlChannel::NoUser)
+                        EraseUser(c, k);
                     UI.IllustrateNote(c, tone, midiins, 0, 0.0);
 
-                    if(ch[c].users.empty())
+                    if(ch[c].users == AdlChannel::NoUser)
                     {
                         opl.NoteOff(c);
                         ch[c].koff_time_until_neglible =
@@ -1564,11 +2044,11 @@ private:
                 {
                     // Sustain: Forget about the note, but don't key it off.
                     //          Also will avoid overwriting it very soon.
-                    AdlChannel::LocationData& d = ch[c].users[my_loc];
+                    AdlChannel::LocationData& d = UserData(c, my_loc);
                     d.sustained = true; // note: not erased!
                     UI.IllustrateNote(c, tone, midiins, -1, 0.0);
                 }
-                info.phys.erase(j);
+                info.ErasePhys(c);
                 continue;
             }
             if(props_mask & Upd_Pan)
@@ -1585,12 +2065,12 @@ private:
                  * Empirical tests however show that a full equal-proportion
                  * increment sounds wrong. Therefore, using the square root.
                  */
-                //volume = (int)(volume * std::sqrt( (double) ch[c].users.size() ));
+                //volume = (int)(volume * std::sqrt( (double) ch[c].n_users ));
                 opl.Touch(c, volume);
             }
             if(props_mask & Upd_Pitch)
             {
-                AdlChannel::LocationData& d = ch[c].users[my_loc];
+                AdlChannel::LocationData& d = UserData(c, my_loc);
                 // Don't bend a sustained note
                 if(!d.sustained)
                 {
@@ -1611,54 +2091,321 @@ private:
                 }
             }
         }
-        if(info.phys.empty())
-            Ch[MidCh].activenotes.erase(i);
+        if(nphys && !info.nphys)
+            --Ch[MidCh].nactive;
     }
 
-    void ProcessEvents()
+    struct CompiledEvent
     {
-        loopEnd = false;
-        const size_t TrackCount = TrackData.size();
-        const Position RowBeginPosition ( CurrentPosition );
-        for(size_t tk = 0; tk < TrackCount; ++tk)
+        unsigned long  tick;
+        unsigned       slot; // Counts the earlier events of the track at this tick
+        unsigned short track;
+        unsigned char  kind, a, b;
+        unsigned       value;
+    };
+
+    // Where a track lies in the song data, which is only read while loading
+    struct TrackSpan
+    {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // Parses a track the way the sequencer used to play it straight from
+    // the file. A bad length or a missing end just end the track.
+    static void CompileTrack(unsigned tk, const unsigned char* data, size_t size,
+                             bool leading_delay, bool implicit_end,
+                             std::vector<CompiledEvent>& events, std::vector<char>& text)
+    {
+        size_t ptr = 0;
+        unsigned char status = 0;
+        unsigned long tick = leading_delay ? ReadVarLen(data, size, ptr) : 0;
+        unsigned long slot_tick = tick;
+        unsigned slot = 0;
+        while(ptr < size)
         {
-            if(CurrentPosition.track[tk].status >= 0
-            && CurrentPosition.track[tk].delay <= 0)
+            if(tick != slot_tick) { slot_tick = tick; slot = 0; }
+            CompiledEvent ev = { tick, slot++, (unsigned short)tk, Ev_Ignore, 0, 0, 0 };
+            bool ended = false;
+
+            unsigned char byte = data[ptr++];
+            if(byte == 0xF7 || byte == 0xF0) // SysEx, only reported
             {
-                // Handle event
-                HandleEvent(tk);
-                // Read next event time (unless the track just ended)
-                if(CurrentPosition.track[tk].ptr >= TrackData[tk].size())
-                    CurrentPosition.track[tk].status = -1;
-                if(CurrentPosition.track[tk].status >= 0)
-                    CurrentPosition.track[tk].delay += ReadVarLen(tk);
+                unsigned long length = ReadVarLen(data, size, ptr);
+                ev.kind  = Ev_SysEx;
+                ev.a     = byte;
+                ev.value = length;
+                ptr += std::min(length, (unsigned long)(size - ptr));
+            }
+            else if(byte == 0xFF)
+            {
+                // Special event FF
+                unsigned char evtype = ptr < size ? data[ptr++] : 0;
+                unsigned long length = ReadVarLen(data, size, ptr);
+                length = std::min(length, (unsigned long)(size - ptr));
+                const unsigned char* payload = data + ptr;
+                ptr += length;
+                if(evtype == 0x2F)
+                    ended = true;
+                else if(evtype == 0x51)
+                {
+                    ev.kind  = Ev_Tempo;
+                    ev.value = ReadBEint(payload, length);
+                }
+                else if(evtype == 9 || (evtype >= 1 && evtype <= 6))
+                {
+                    if(evtype == 6 && length == 9 && !std::memcmp(payload, "loopStart", 9))
+                        { ev.kind = Ev_LoopStart; events.push_back(ev); }
+                    if(evtype == 6 && length == 7 && !std::memcmp(payload, "loopEnd", 7))
+                        { ev.kind = Ev_LoopEnd; events.push_back(ev); }
+                    ev.kind  = evtype == 9 ? Ev_Device : Ev_Text;
+                    ev.a     = evtype;
+                    ev.value = text.size();
+                    text.insert(text.end(), payload, payload + length);
+                    text.push_back('\0');
+                }
+                else if(evtype == 0xE3 && length >= 2)
+                {
+                    // Special non-spec ADLMIDI special for IMF playback: Direct poke to AdLib
+                    ev.kind = Ev_Poke;
+                    ev.a    = payload[0];
+                    ev.b    = payload[1];
+                    if( (ev.a&0xF0) == 0xC0 ) ev.b |= 0x30;
+                }
+            }
+            else
+            {
+                // Any normal event (80..EF)
+                if(byte < 0x80) { byte = status | 0x80; --ptr; }
+                unsigned nbytes = 0;
+                if(byte == 0xF3) nbytes = 1;
+                else if(byte == 0xF2) nbytes = 2;
+                else
+                {
+                    status = byte;
+                    switch(byte >> 4)
+                    {
+                        case 0x8: case 0x9: case 0xA: case 0xB: case 0xE:
+                            nbytes = 2; break;
+                        case 0xC: case 0xD:
+                            nbytes = 1; break;
+                    }
+                    if(byte < 0xF0) ev.kind = byte;
+                }
+                if(nbytes > size - ptr) { nbytes = size - ptr; ended = true; }
+                if(nbytes > 0) ev.a = data[ptr];
+                if(nbytes > 1) ev.b = data[ptr + 1];
+                ptr += nbytes;
+                if(ended) ev.kind = Ev_Ignore;
+            }
+            events.push_back(ev);
+            if(ended || ptr >= size) break;
+            tick += ReadVarLen(data, size, ptr);
+            if(implicit_end && ptr >= size)
+            {
+                // The track stops without an end event, after its last delay
+                if(tick != slot_tick) slot = 0;
+                CompiledEvent end = { tick, slot, (unsigned short)tk, Ev_Ignore, 0, 0, 0 };
+                events.push_back(end);
             }
         }
-        // Find shortest delay from all track
-        long shortest = -1;
-        for(size_t tk=0; tk<TrackCount; ++tk)
-            if(CurrentPosition.track[tk].status >= 0
-            && (shortest == -1
-               || CurrentPosition.track[tk].delay < shortest))
+    }
+
+    void CompileEvents(const std::vector<TrackSpan>& tracks,
+                       bool leading_delay, bool implicit_end)
+    {
+        std::vector<CompiledEvent> events;
+        EventList list;
+        for(size_t tk = 0; tk < tracks.size(); ++tk)
+            if(tracks[tk].size)
+                CompileTrack(tk, tracks[tk].data, tracks[tk].size,
+                             leading_delay, implicit_end, events, list.text);
+
+        // Every track that is due gives its next event to the row, the
+        // earlier tracks first
+        std::stable_sort(events.begin(), events.end(),
+            [](const CompiledEvent& x, const CompiledEvent& y)
+            {
+                return x.tick < y.tick || (x.tick == y.tick && x.slot < y.slot);
+            });
+
+        const size_t n = events.size();
+        list.kind.resize(n);  list.a.resize(n);     list.b.resize(n);
+        list.track.resize(n); list.value.resize(n);
+        // The first row is at the start of the song even if it's empty
+        list.rowBegin.push_back(0);
+        list.rowTick.push_back(0);
+        for(size_t e = 0; e < n; ++e)
+        {
+            const CompiledEvent& ev = events[e];
+            if(e ? ev.tick != events[e-1].tick || ev.slot != events[e-1].slot
+                 : ev.tick || ev.slot)
             {
-                shortest = CurrentPosition.track[tk].delay;
+                if(e) list.rowBegin.push_back(e);
+                list.rowTick.push_back(ev.tick);
             }
-        //if(shortest > 0) UI.PrintLn("shortest: %ld", shortest);
+            list.kind[e]  = ev.kind;
+            list.a[e]     = ev.a;
+            list.b[e]     = ev.b;
+            list.track[e] = ev.track;
+            list.value[e] = ev.value;
+        }
+        list.rowBegin.push_back(n);
+        Events.kind.swap(list.kind);
+        Events.a.swap(list.a);
+        Events.b.swap(list.b);
+        Events.track.swap(list.track);
+        Events.value.swap(list.value);
+        Events.text.swap(list.text);
+        Events.rowBegin.swap(list.rowBegin);
+        Events.rowTick.swap(list.rowTick);
+    }
+
+    // Goes through the tempo changes and loop markers of the compiled
+    // events once. The loop is where playing it would loop first: at the
+    // first loopEnd, or at the end, back to the last loopStart before it.
+    void BuildTempoMap()
+    {
+        TempoMap.clear();
+        TempoSegment first = { 0, 0.0, (double)Tempo.valuel() };
+        TempoMap.push_back(first);
+        unsigned long loop_start = 0, loop_end = 0;
+        bool loop_ended = false;
+        const size_t rows = Events.rowTick.size();
+        for(size_t row = 0; row < rows; ++row)
+        {
+            const unsigned long tick = Events.rowTick[row];
+            for(size_t e = Events.rowBegin[row]; e < Events.rowBegin[row+1]; ++e)
+            {
+                if(Events.kind[e] == Ev_Tempo)
+                {
+                    TempoSegment seg = { tick, TickToTime(tick),
+                        (double)(InvDeltaTicks * fraction<long>( (long) Events.value[e])).valuel() };
+                    if(TempoMap.back().tick == tick)
+                        TempoMap.back() = seg;
+                    else
+                        TempoMap.push_back(seg);
+                }
+                if(Events.kind[e] == Ev_LoopStart && !loop_ended) loop_start = tick;
+                if(Events.kind[e] == Ev_LoopEnd && !loop_ended) { loop_end = tick; loop_ended = true; }
+            }
+        }
+        const unsigned long end = Events.rowTick[rows - 1];
+        SongLength    = TickToTime(end);
+        LoopStartTime = TickToTime(loop_start);
+        LoopEndTime   = TickToTime(loop_ended ? loop_end : end);
+    }
+
+    void SaveSeekPoint(SeekPoint& point, size_t row, bool began,
+                       const std::vector<unsigned short>& notes) const
+    {
+        point.row       = row;
+        point.began     = began;
+        point.loopStart = loopStart;
+        point.loopBegin = LoopBeginPosition;
+        point.tempo     = Tempo;
+        point.cmf_percussion_mode = cmf_percussion_mode;
+        point.channels  = Ch;
+        point.devices   = current_device;
+        point.notes     = notes;
+    }
+    void LoadSeekPoint(const SeekPoint& point, std::vector<unsigned short>& notes, bool& began)
+    {
+        // Channels of ports named later stay, in their initial state
+        const size_t channels = Ch.size();
+        Ch = point.channels;
+        for(size_t a = 0; a < Ch.size(); ++a) Ch[a].ClearNotes();
+        if(Ch.size() < channels) Ch.resize(channels);
+        began               = point.began;
+        loopStart           = point.loopStart;
+        LoopBeginPosition   = point.loopBegin;
+        Tempo               = point.tempo;
+        cmf_percussion_mode = point.cmf_percussion_mode;
+        current_device      = point.devices;
+        notes               = point.notes;
+    }
+
+    // A row of ProcessEvents without the sound. The notes go into notes
+    // and the rest through HandleEvent, which only changes the channel
+    // settings when no note is playing. Text and SysEx are not reported.
+    void ReplayRow(size_t row, std::vector<unsigned short>& notes, bool& began)
+    {
+        Position RowBeginPosition;
+        RowBeginPosition.began = began;
+        RowBeginPosition.row   = row;
+        for(size_t e = Events.rowBegin[row]; e < Events.rowBegin[row+1]; ++e)
+        {
+            const unsigned char kind = Events.kind[e];
+            if(kind == Ev_Text || kind == Ev_SysEx) continue;
+            if(kind < Ev_Channel) { HandleEvent(e); continue; }
+
+            const unsigned MidCh = (kind & 0x0F) + current_device[Events.track[e]];
+            if(notes.size() < Ch.size() * 128) notes.resize(Ch.size() * 128);
+            unsigned short* keys = &notes[MidCh * 128];
+            unsigned short& key  = keys[Events.a[e] & 0x7F];
+            switch(kind >> 4)
+            {
+                case 0x8: // Note off
+                case 0x9: // Note on
+                    if(CartoonersVolumes && Events.b[e] && (key & Note_Held))
+                        { key = Note_Held | Events.b[e]; break; }
+                    if(key & Note_Held)
+                        key = Ch[MidCh].sustain ? Note_Sustained | (key & 0xFF) : 0;
+                    if(Events.b[e] && (kind >> 4) == 0x9)
+                        { key = Note_Held | Events.b[e]; began = true; }
+                    break;
+                case 0xA: // Note touch
+                    if(key & Note_Held) key = Note_Held | Events.b[e];
+                    break;
+                case 0xD: // Channel after-touch
+                    for(unsigned n = 0; n < 128; ++n)
+                        if(keys[n] & Note_Held) keys[n] = Note_Held | Events.a[e];
+                    break;
+                case 0xB: // Controller change
+                    HandleEvent(e);
+                    if((Events.a[e] == 64 && !Events.b[e]) || Events.a[e] == 121)
+                    {
+                        for(unsigned n = 0; n < 128; ++n)
+                            if(keys[n] & Note_Sustained) keys[n] = 0;
+                    }
+                    else if(Events.a[e] == 123)
+                    {
+                        for(unsigned n = 0; n < 128; ++n)
+                            if(keys[n] & Note_Held)
+                                keys[n] = Ch[MidCh].sustain ? Note_Sustained | (keys[n] & 0xFF) : 0;
+                    }
+                    break;
+                default:
+                    HandleEvent(e);
+            }
+        }
+        if(loopStart)
+        {
+            LoopBeginPosition = RowBeginPosition;
+            loopStart = false;
+        }
+        loopEnd = false;
+    }
+
+    void ProcessEvents()
+    {
+        loopEnd = false;
+        const Position RowBeginPosition ( CurrentPosition );
+        const size_t row = CurrentPosition.row++;
+        for(size_t e = Events.rowBegin[row]; e < Events.rowBegin[row+1]; ++e)
+            HandleEvent(e);
 
-        // Schedule the next playevent to be processed after that delay
-        for(size_t tk=0; tk<TrackCount; ++tk)
-            CurrentPosition.track[tk].delay -= shortest;
+        // The delay until the next row, or -1 at the end of the song
+        long shortest = -1;
+        if(row + 1 < Events.rowTick.size())
+            shortest = Events.rowTick[row+1] - Events.rowTick[row];
+        //if(shortest > 0) UI.PrintLn("shortest: %ld", shortest);
 
         fraction<long> t = shortest * Tempo;
         if(CurrentPosition.began) CurrentPosition.wait += t.valuel();
 
         //if(shortest > 0) UI.PrintLn("Delay %ld (%g)", shortest, (double)t.valuel());
 
-        /*
-        if(CurrentPosition.track[0].ptr > 8119) loopEnd = true;
-        // ^HACK: CHRONO TRIGGER LOOP
-        */
-
         if(loopStart)
         {
             LoopBeginPosition = RowBeginPosition;
@@ -1678,70 +2425,210 @@ private:
             }
         }
     }
-    void HandleEvent(size_t tk)
+    // Allocates AdLib channels for a new note and keys it on
+    void NoteOn(unsigned MidCh, int note, int vol)
     {
-        unsigned char byte = TrackData[tk][CurrentPosition.track[tk].ptr++];
-        if(byte == 0xF7 || byte == 0xF0) // Ignore SysEx
+        unsigned midiins = Ch[MidCh].patch;
+        if(MidCh%16 == 9) midiins = 128 + note; // Percussion instrument
+
+        /*
+        if(MidCh%16 == 9 || (midiins != 32 && midiins != 46 && midiins != 48 && midiins != 50))
+            break; // HACK
+        if(midiins == 46) vol = (vol*7)/10;          // HACK
+        if(midiins == 48 || midiins == 50) vol /= 4; // HACK
+        */
+        //if(midiins == 56) vol = vol*6/10; // HACK
+
+        static std::set<unsigned> bank_warnings;
+        if(Ch[MidCh].bank_msb)
         {
-            unsigned length = ReadVarLen(tk);
-            //std::string data( length?(const char*) &TrackData[tk][CurrentPosition.track[tk].ptr]:0, length );
-            CurrentPosition.track[tk].ptr += length;
-            UI.PrintLn("SysEx %02X: %u bytes", byte, length/*, data.c_str()*/);
-            return;
+            unsigned bankid = midiins + 256*Ch[MidCh].bank_msb;
+            std::set<unsigned>::iterator
+                i = bank_warnings.lower_bound(bankid);
+            if(i == bank_warnings.end() || *i != bankid)
+            {
+                UI.PrintLn("[%u]Bank %u undefined, patch=%c%u",
+                    MidCh,
+                    Ch[MidCh].bank_msb,
+                    (midiins&128)?'P':'M', midiins&127);
+                bank_warnings.insert(i, bankid);
+            }
+        }
+        if(Ch[MidCh].bank_lsb)
+        {
+            unsigned bankid = Ch[MidCh].bank_lsb*65536;
+            std::set<unsigned>::iterator
+                i = bank_warnings.lower_bound(bankid);
+            if(i == bank_warnings.end() || *i != bankid)
+            {
+                UI.PrintLn("[%u]Bank lsb %u undefined",
+                    MidCh,
+                    Ch[MidCh].bank_lsb);
+                bank_warnings.insert(i, bankid);
+            }
+        }
+
+        const unsigned meta    = GetAdlMetaNumber(midiins);
+        const adlinsdata& ains = GetAdlMetaIns(meta);
+
+        int tone = note;
+        if(ains.tone)
+        {
+            // 0..19:    add x
+            // 20..127:  set x
+            // 128..255: subtract x-128
+            if(ains.tone < 20)
+                tone += ains.tone;
+            else if(ains.tone < 128)
+                tone = ains.tone;
+            else
+                tone -= ains.tone-128;
+        }
+        int i[2] = { ains.adlno1, ains.adlno2 };
+        bool pseudo_4op = ains.flags & adlinsdata::Flag_Pseudo4op;
+
+        if(AdlPercussionMode && PercussionMap[midiins & 0xFF]) i[1] = i[0];
+
+        static std::set<unsigned char> missing_warnings;
+        if(!missing_warnings.count(midiins) && (ains.flags & adlinsdata::Flag_NoSound))
+        {
+            UI.PrintLn("[%i]Playing missing instrument %i", MidCh, midiins);
+            missing_warnings.insert(midiins);
         }
-        if(byte == 0xFF)
+
+        // Allocate AdLib channel (the physical sound channel for the note)
+        int adlchannel[2] = { -1, -1 };
+        for(unsigned ccount = 0; ccount < 2; ++ccount)
         {
-            // Special event FF
-            unsigned char evtype = TrackData[tk][CurrentPosition.track[tk].ptr++];
-            unsigned long length = ReadVarLen(tk);
-            std::string data( length?(const char*) &TrackData[tk][CurrentPosition.track[tk].ptr]:0, length );
-            CurrentPosition.track[tk].ptr += length;
-            if(evtype == 0x2F) { CurrentPosition.track[tk].status = -1; return; }
-            if(evtype == 0x51) { Tempo = InvDeltaTicks * fraction<long>( (long) ReadBEint(data.data(), data.size())); return; }
-            if(evtype == 6 && data == "loopStart") loopStart = true;
-            if(evtype == 6 && data == "loopEnd"  ) loopEnd   = true;
-            if(evtype == 9) current_device[tk] = ChooseDevice(data);
-            if(evtype >= 1 && evtype <= 6)
-                UI.PrintLn("Meta %d: %s", evtype, data.c_str());
+            if(ccount == 1)
+            {
+                if(i[0] == i[1]) break; // No secondary channel
+                if(adlchannel[0] == -1) break; // No secondary if primary failed
+            }
+
+            int c = -1;
+            long bs = -0x7FFFFFFFl;
+            for(int a = 0; a < (int)opl.NumChannels; ++a)
+            {
+                if(ccount == 1 && a == adlchannel[0]) continue;
+                // ^ Don't use the same channel for primary&secondary
+
+                if(i[0] == i[1] || pseudo_4op)
+                {
+                    // Only use regular channels
+                    int expected_mode = 0;
+                    if(AdlPercussionMode)
+                    {
+                        if(cmf_percussion_mode)
+                            expected_mode = MidCh < 11 ? 0 : (3+MidCh-11); // CMF
+                        else
+                            expected_mode = PercussionMap[midiins & 0xFF];
+                    }
+                    if(opl.four_op_category[a] != expected_mode)
+                        continue;
+                }
+                else
+                {
+                    if(ccount == 0)
+                    {
+                        // Only use four-op master channels
+                        if(opl.four_op_category[a] != 1)
+                            continue;
+                    }
+                    else
+                    {
+                        // The secondary must be played on a specific channel.
+                        if(a != adlchannel[0] + 3)
+                            continue;
+                    }
+                }
+
+                long s = CalculateAdlChannelGoodness(a, i[ccount], MidCh);
+                if(s > bs) { bs=s; c = a; } // Best candidate wins
+            }
 
-            if(evtype == 0xE3) // Special non-spec ADLMIDI special for IMF playback: Direct poke to AdLib
+            if(c < 0)
             {
-                unsigned char i = data[0], v = data[1];
-                if( (i&0xF0) == 0xC0 ) v |= 0x30;
-                //fprintf(stderr, "OPL poke %02X, %02X\n", i,v);
-                opl.Poke(0, i,v);
+                //UI.PrintLn("ignored unplaceable note");
+                continue; // Could not play this note. Ignore it.
             }
+            PrepareAdlChannelForNewNote(c, i[ccount]);
+            adlchannel[ccount] = c;
+        }
+        if(adlchannel[0] < 0 && adlchannel[1] < 0)
+        {
+            // The note could not be played, at all.
             return;
         }
-        // Any normal event (80..EF)
-        if(byte < 0x80)
-          { byte = CurrentPosition.track[tk].status | 0x80;
-            CurrentPosition.track[tk].ptr--; }
-        if(byte == 0xF3) { CurrentPosition.track[tk].ptr += 1; return; }
-        if(byte == 0xF2) { CurrentPosition.track[tk].ptr += 2; return; }
-        /*UI.PrintLn("@%X Track %u: %02X %02X",
-            CurrentPosition.track[tk].ptr-1, (unsigned)tk, byte,
-            TrackData[tk][CurrentPosition.track[tk].ptr]);*/
+        //UI.PrintLn("i1=%d:%d, i2=%d:%d", i[0],adlchannel[0], i[1],adlchannel[1]);
+
+        // Allocate active note for MIDI channel
+        MIDIchannel::NoteInfo& info = Ch[MidCh].activenotes[note];
+        if(!info.nphys) ++Ch[MidCh].nactive;
+        info.vol     = vol;
+        info.tone    = tone;
+        info.midiins = midiins;
+        info.insmeta = meta;
+        for(unsigned ccount=0; ccount<2; ++ccount)
+        {
+            int c = adlchannel[ccount];
+            if(c < 0) continue;
+            info.SetPhys(adlchannel[ccount], i[ccount]);
+        }
+        CurrentPosition.began  = true;
+        NoteUpdate(MidCh, note, Upd_All | Upd_Patch);
+    }
+
+    void HandleEvent(size_t e)
+    {
+        const unsigned tk = Events.track[e];
+        const unsigned char byte = Events.kind[e];
+        switch(byte)
+        {
+            case Ev_Ignore:
+                return;
+            case Ev_SysEx:
+                UI.PrintLn("SysEx %02X: %u bytes", Events.a[e], Events.value[e]);
+                return;
+            case Ev_Tempo:
+                Tempo = InvDeltaTicks * fraction<long>( (long) Events.value[e]);
+                return;
+            case Ev_LoopStart:
+                loopStart = true;
+                return;
+            case Ev_LoopEnd:
+                loopEnd = true;
+                return;
+            case Ev_Text:
+                UI.PrintLn("Meta %d: %s", Events.a[e], &Events.text[Events.value[e]]);
+                return;
+            case Ev_Device:
+                current_device[tk] = ChooseDevice(&Events.text[Events.value[e]]);
+                return;
+            case Ev_Poke:
+                //fprintf(stderr, "OPL poke %02X, %02X\n", Events.a[e], Events.b[e]);
+                opl.Poke(0, Events.a[e], Events.b[e]);
+                return;
+        }
+        /*UI.PrintLn("Track %u: %02X %02X", tk, byte, Events.a[e]);*/
         unsigned MidCh = byte & 0x0F, EvType = byte >> 4;
         MidCh += current_device[tk];
 
-        CurrentPosition.track[tk].status = byte;
         switch(EvType)
         {
             case 0x8: // Note off
             case 0x9: // Note on
             {
-                int note = TrackData[tk][CurrentPosition.track[tk].ptr++];
-                int  vol = TrackData[tk][CurrentPosition.track[tk].ptr++];
+                int note = Events.a[e];
+                int  vol = Events.b[e];
                 //if(MidCh != 9) note -= 12; // HACK for OpenGL video for changing octaves
                 if(CartoonersVolumes && vol != 0)
                 {
                     // Check if this is just a note after-touch
-                    auto i = Ch[MidCh].activenotes.find(note);
-                    if(i != Ch[MidCh].activenotes.end())
+                    if(Ch[MidCh].NoteActive(note))
                     {
-                        i->second.vol = vol;
-                        NoteUpdate(MidCh, i, Upd_Volume);
+                        Ch[MidCh].activenotes[note].vol = vol;
+                        NoteUpdate(MidCh, note, Upd_Volume);
                         break;
                     }
                 }
@@ -1752,175 +2639,26 @@ private:
                 // check if we still need to do a Keyon.
                 // vol=0 and event 8x are both Keyoff-only.
                 if(vol == 0 || EvType == 0x8) break;
-
-                unsigned midiins = Ch[MidCh].patch;
-                if(MidCh%16 == 9) midiins = 128 + note; // Percussion instrument
-
-                /*
-                if(MidCh%16 == 9 || (midiins != 32 && midiins != 46 && midiins != 48 && midiins != 50))
-                    break; // HACK
-                if(midiins == 46) vol = (vol*7)/10;          // HACK
-                if(midiins == 48 || midiins == 50) vol /= 4; // HACK
-                */
-                //if(midiins == 56) vol = vol*6/10; // HACK
-
-                static std::set<unsigned> bank_warnings;
-                if(Ch[MidCh].bank_msb)
-                {
-                    unsigned bankid = midiins + 256*Ch[MidCh].bank_msb;
-                    std::set<unsigned>::iterator
-                        i = bank_warnings.lower_bound(bankid);
-                    if(i == bank_warnings.end() || *i != bankid)
-                    {
-                        UI.PrintLn("[%u]Bank %u undefined, patch=%c%u",
-                            MidCh,
-                            Ch[MidCh].bank_msb,
-                            (midiins&128)?'P':'M', midiins&127);
-                        bank_warnings.insert(i, bankid);
-                    }
-                }
-                if(Ch[MidCh].bank_lsb)
-                {
-                    unsigned bankid = Ch[MidCh].bank_lsb*65536;
-                    std::set<unsigned>::iterator
-                        i = bank_warnings.lower_bound(bankid);
-                    if(i == bank_warnings.end() || *i != bankid)
-                    {
-                        UI.PrintLn("[%u]Bank lsb %u undefined",
-                            MidCh,
-                            Ch[MidCh].bank_lsb);
-                        bank_warnings.insert(i, bankid);
-                    }
-                }
-
-                const unsigned meta    = GetAdlMetaNumber(midiins);
-                const adlinsdata& ains = GetAdlMetaIns(meta);
-
-                int tone = note;
-                if(ains.tone)
-                {
-                    // 0..19:    add x
-                    // 20..127:  set x
-                    // 128..255: subtract x-128
-                    if(ains.tone < 20)
-                        tone += ains.tone;
-                    else if(ains.tone < 128)
-                        tone = ains.tone;
-                    else
-                        tone -= ains.tone-128;
-                }
-                int i[2] = { ains.adlno1, ains.adlno2 };
-                bool pseudo_4op = ains.flags & adlinsdata::Flag_Pseudo4op;
-
-                if(AdlPercussionMode && PercussionMap[midiins & 0xFF]) i[1] = i[0];
-
-                static std::set<unsigned char> missing_warnings;
-                if(!missing_warnings.count(midiins) && (ains.flags & adlinsdata::Flag_NoSound))
-                {
-                    UI.PrintLn("[%i]Playing missing instrument %i", MidCh, midiins);
-                    missing_warnings.insert(midiins);
-                }
-
-                // Allocate AdLib channel (the physical sound channel for the note)
-                int adlchannel[2] = { -1, -1 };
-                for(unsigned ccount = 0; ccount < 2; ++ccount)
-                {
-                    if(ccount == 1)
-                    {
-                        if(i[0] == i[1]) break; // No secondary channel
-                        if(adlchannel[0] == -1) break; // No secondary if primary failed
-                    }
-
-                    int c = -1;
-                    long bs = -0x7FFFFFFFl;
-                    for(int a = 0; a < (int)opl.NumChannels; ++a)
-                    {
-                        if(ccount == 1 && a == adlchannel[0]) continue;
-                        // ^ Don't use the same channel for primary&secondary
-
-                        if(i[0] == i[1] || pseudo_4op)
-                        {
-                            // Only use regular channels
-                            int expected_mode = 0;
-                            if(AdlPercussionMode)
-                            {
-                                if(cmf_percussion_mode)
-                                    expected_mode = MidCh < 11 ? 0 : (3+MidCh-11); // CMF
-                                else
-                                    expected_mode = PercussionMap[midiins & 0xFF];
-                            }
-                            if(opl.four_op_category[a] != expected_mode)
-                                continue;
-                        }
-                        else
-                        {
-                            if(ccount == 0)
-                            {
-                                // Only use four-op master channels
-                                if(opl.four_op_category[a] != 1)
-                                    continue;
-                            }
-                            else
-                            {
-                                // The secondary must be played on a specific channel.
-                                if(a != adlchannel[0] + 3)
-                                    continue;
-                            }
-                        }
-
-                        long s = CalculateAdlChannelGoodness(a, i[ccount], MidCh);
-                        if(s > bs) { bs=s; c = a; } // Best candidate wins
-                    }
-
-                    if(c < 0)
-                    {
-                        //UI.PrintLn("ignored unplaceable note");
-                        continue; // Could not play this note. Ignore it.
-                    }
-                    PrepareAdlChannelForNewNote(c, i[ccount]);
-                    adlchannel[ccount] = c;
-                }
-                if(adlchannel[0] < 0 && adlchannel[1] < 0)
-                {
-                    // The note could not be played, at all.
-                    break;
-                }
-                //UI.PrintLn("i1=%d:%d, i2=%d:%d", i[0],adlchannel[0], i[1],adlchannel[1]);
-
-                // Allocate active note for MIDI channel
-                auto ir = Ch[MidCh].activenotes.insert(std::make_pair(note, MIDIchannel::NoteInfo()));
-                ir.first->second.vol     = vol;
-                ir.first->second.tone    = tone;
-                ir.first->second.midiins = midiins;
-                ir.first->second.insmeta = meta;
-                for(unsigned ccount=0; ccount<2; ++ccount)
-                {
-                    int c = adlchannel[ccount];
-                    if(c < 0) continue;
-                    ir.first->second.phys[ adlchannel[ccount] ] = i[ccount];
-                }
-                CurrentPosition.began  = true;
-                NoteUpdate(MidCh, ir.first, Upd_All | Upd_Patch);
+                NoteOn(MidCh, note, vol);
                 break;
             }
             case 0xA: // Note touch
             {
-                int note = TrackData[tk][CurrentPosition.track[tk].ptr++];
-                int  vol = TrackData[tk][CurrentPosition.track[tk].ptr++];
-                auto i = Ch[MidCh].activenotes.find(note);
-                if(i == Ch[MidCh].activenotes.end())
+                int note = Events.a[e];
+                int  vol = Events.b[e];
+                if(!Ch[MidCh].NoteActive(note))
                 {
                     // Ignore touch if note is not active
                     break;
                 }
-                i->second.vol = vol;
-                NoteUpdate(MidCh, i, Upd_Volume);
+                Ch[MidCh].activenotes[note].vol = vol;
+                NoteUpdate(MidCh, note, Upd_Volume);
                 break;
             }
             case 0xB: // Controller change
             {
-                int ctrlno = TrackData[tk][CurrentPosition.track[tk].ptr++];
-                int  value = TrackData[tk][CurrentPosition.track[tk].ptr++];
+                int ctrlno = Events.a[e];
+                int  value = Events.b[e];
                 switch(ctrlno)
                 {
                     case 1: // Adjust vibrato
@@ -2001,21 +2739,22 @@ private:
                 break;
             }
             case 0xC: // Patch change
-                Ch[MidCh].patch = TrackData[tk][CurrentPosition.track[tk].ptr++];
+                Ch[MidCh].patch = Events.a[e];
                 break;
             case 0xD: // Channel after-touch
             {
                 // TODO: Verify, is this correct action?
-                int  vol = TrackData[tk][CurrentPosition.track[tk].ptr++];
+                int  vol = Events.a[e];
                 // Set this pressure to all active notes on the channel
-                for(auto& ch: Ch[MidCh].activenotes) { ch.second.vol = vol; }
+                for(unsigned n = 0; n < 128; ++n)
+                    if(Ch[MidCh].NoteActive(n)) Ch[MidCh].activenotes[n].vol = vol;
                 NoteUpdate_All(MidCh, Upd_Volume);
                 break;
             }
             case 0xE: // Wheel/pitch bend
             {
-                int a = TrackData[tk][CurrentPosition.track[tk].ptr++];
-                int b = TrackData[tk][CurrentPosition.track[tk].ptr++];
+                int a = Events.a[e];
+                int b = Events.b[e];
                 Ch[MidCh].bend = (a + b*128 - 8192) * Ch[MidCh].bendsense;
                 NoteUpdate_All(MidCh, Upd_Pitch);
                 break;
@@ -2032,37 +2771,34 @@ private:
 
         // Same midi-instrument = some stability
         //if(c == MidCh) s += 4;
-        for(AdlChannel::users_t::const_iterator
-            j = ch[c].users.begin();
-            j != ch[c].users.end();
-            ++j)
+        for(unsigned u = ch[c].users; u != AdlChannel::NoUser; u = UserPool[u].next)
         {
+            const AdlChannel::User& j = UserPool[u];
             s -= 4000;
-            if(!j->second.sustained)
-                s -= j->second.kon_time_until_neglible;
+            if(!j.data.sustained)
+                s -= j.data.kon_time_until_neglible;
             else
-                s -= j->second.kon_time_until_neglible / 2;
+                s -= j.data.kon_time_until_neglible / 2;
 
-            MIDIchannel::activenotemap_t::const_iterator
-                k = Ch[j->first.MidCh].activenotes.find(j->first.note);
-            if(k != Ch[j->first.MidCh].activenotes.end())
+            if(Ch[j.loc.MidCh].NoteActive(j.loc.note))
             {
+                const MIDIchannel::NoteInfo& k = Ch[j.loc.MidCh].activenotes[j.loc.note];
                 // Same instrument = good
-                if(j->second.ins == ins)
+                if(j.data.ins == ins)
                 {
                     s += 300;
                     // Arpeggio candidate = even better
-                    if(j->second.vibdelay < 70
-                    || j->second.kon_time_until_neglible > 20000)
+                    if(j.data.vibdelay < 70
+                    || j.data.kon_time_until_neglible > 20000)
                         s += 0;
                 }
                 // Percussion is inferior to melody
-                s += 50 * (k->second.midiins / 128);
+                s += 50 * (k.midiins / 128);
 
                 /*
-                if(k->second.midiins >= 25
-                && k->second.midiins < 40
-                && j->second.ins != ins)
+                if(k.midiins >= 25
+                && k.midiins < 40
+                && j.data.ins != ins)
                 {
                     s -= 14000; // HACK: Don't clobber the bass or the guitar
                 }
@@ -2078,14 +2814,11 @@ private:
                 if(c2 == c) continue;
                 if(opl.four_op_category[c2]
                 != opl.four_op_category[c]) continue;
-                for(AdlChannel::users_t::const_iterator
-                    m = ch[c2].users.begin();
-                    m != ch[c2].users.end();
-                    ++m)
+                for(unsigned m = ch[c2].users; m != AdlChannel::NoUser; m = UserPool[m].next)
                 {
-                    if(m->second.sustained)       continue;
-                    if(m->second.vibdelay >= 200) continue;
-                    if(m->second.ins != j->second.ins) continue;
+                    if(UserPool[m].data.sustained)       continue;
+                    if(UserPool[m].data.vibdelay >= 200) continue;
+                    if(UserPool[m].data.ins != j.data.ins) continue;
                     n_evacuation_stations += 1;
                 }
             }
@@ -2098,33 +2831,28 @@ private:
     // Kill existing notes on this channel (or don't, if we do arpeggio)
     void PrepareAdlChannelForNewNote(int c, int ins)
     {
-        if(ch[c].users.empty()) return; // Nothing to do
+        if(ch[c].users == AdlChannel::NoUser) return; // Nothing to do
         //bool doing_arpeggio = false;
-        for(AdlChannel::users_t::iterator
-            jnext = ch[c].users.begin();
-            jnext != ch[c].users.end();
-            )
+        for(unsigned jnext = ch[c].users; jnext != AdlChannel::NoUser; )
         {
-            AdlChannel::users_t::iterator j(jnext++);
-            if(!j->second.sustained)
+            unsigned j = jnext;
+            jnext = UserPool[j].next;
+            if(!UserPool[j].data.sustained)
             {
                 // Collision: Kill old note,
                 // UNLESS we're going to do arpeggio
 
-                MIDIchannel::activenoteiterator i
-                ( Ch[j->first.MidCh].activenotes.find( j->first.note ) );
-
                 // Check if we can do arpeggio.
-                if((j->second.vibdelay < 70
-                 || j->second.kon_time_until_neglible > 20000)
-                && j->second.ins == ins)
+                if((UserPool[j].data.vibdelay < 70
+                 || UserPool[j].data.kon_time_until_neglible > 20000)
+                && UserPool[j].data.ins == ins)
                 {
                     // Do arpeggio together with this note.
                     //doing_arpeggio = true;
                     continue;
                 }
 
-                KillOrEvacuate(c,j,i);
+                KillOrEvacuate(c,j);
                 // ^ will also erase j from ch[c].users.
             }
         }
@@ -2136,15 +2864,17 @@ private:
 
         // Keyoff the channel so that it can be retriggered,
         // unless the new note will be introduced as just an arpeggio.
-        if(ch[c].users.empty())
+        if(ch[c].users == AdlChannel::NoUser)
             opl.NoteOff(c);
     }
 
     void KillOrEvacuate(
         unsigned from_channel,
-        AdlChannel::users_t::iterator j,
-        MIDIchannel::activenoteiterator i)
+        unsigned j)
     {
+        const AdlChannel::Location loc = UserPool[j].loc;
+        MIDIchannel::NoteInfo& i = Ch[loc.MidCh].activenotes[loc.note];
+
         // Before killing the note, check if it can be
         // evacuated to another channel as an arpeggio
         // instrument. This helps if e.g. all channels
@@ -2156,31 +2886,34 @@ private:
             if(opl.four_op_category[c]
             != opl.four_op_category[from_channel]
               ) continue;
-            for(AdlChannel::users_t::iterator
-                m = ch[c].users.begin();
-                m != ch[c].users.end();
-                ++m)
+            for(unsigned m = ch[c].users; m != AdlChannel::NoUser; m = UserPool[m].next)
             {
-                if(m->second.vibdelay >= 200
-                && m->second.kon_time_until_neglible < 10000) continue;
-                if(m->second.ins != j->second.ins) continue;
+                if(UserPool[m].data.vibdelay >= 200
+                && UserPool[m].data.kon_time_until_neglible < 10000) continue;
+                if(UserPool[m].data.ins != UserPool[j].data.ins) continue;
 
                 // the note can be moved here!
                 UI.IllustrateNote(
                     from_channel,
-                    i->second.tone,
-                    i->second.midiins, 0, 0.0);
+                    i.tone,
+                    i.midiins, 0, 0.0);
                 UI.IllustrateNote(
                     c,
-                    i->second.tone,
-                    i->second.midiins,
-                    i->second.vol,
+                    i.tone,
+                    i.midiins,
+                    i.vol,
                     0.0);
 
-                i->second.phys.erase(from_channel);
-                i->second.phys[c] = j->second.ins;
-                ch[c].users.insert( *j );
-                ch[from_channel].users.erase( j );
+                i.ErasePhys(from_channel);
+                i.SetPhys(c, UserPool[j].data.ins);
+                // A user the note already has there stays as it is
+                if(FindUser(c, loc) == AdlChannel::NoUser)
+                {
+                    UnlinkUser(from_channel, j);
+                    LinkUser(c, j);
+                }
+                else
+                    EraseUser(from_channel, j);
                 return;
             }
         }
@@ -2194,8 +2927,8 @@ private:
             );*/
 
         // Kill it
-        NoteUpdate(j->first.MidCh,
-                   i,
+        NoteUpdate(loc.MidCh,
+                   loc.note,
                    Upd_Off,
                    from_channel);
     }
@@ -2206,23 +2939,21 @@ private:
         if(this_adlchn >= 0) { first=this_adlchn; last=first+1; }
         for(unsigned c = first; c < last; ++c)
         {
-            if(ch[c].users.empty()) continue; // Nothing to do
-            for(AdlChannel::users_t::iterator
-                jnext = ch[c].users.begin();
-                jnext != ch[c].users.end();
-                )
+            if(ch[c].users == AdlChannel::NoUser) continue; // Nothing to do
+            for(unsigned jnext = ch[c].users; jnext != AdlChannel::NoUser; )
             {
-                AdlChannel::users_t::iterator j(jnext++);
-                if((MidCh < 0 || j->first.MidCh == MidCh)
-                && j->second.sustained)
+                unsigned j = jnext;
+                jnext = UserPool[j].next;
+                if((MidCh < 0 || UserPool[j].loc.MidCh == MidCh)
+                && UserPool[j].data.sustained)
                 {
                     int midiins = '?';
-                    UI.IllustrateNote(c, j->first.note, midiins, 0, 0.0);
-                    ch[c].users.erase(j);
+                    UI.IllustrateNote(c, UserPool[j].loc.note, midiins, 0, 0.0);
+                    EraseUser(c, j);
                 }
             }
             // Keyoff the channel, if there are no users left.
-            if(ch[c].users.empty())
+            if(ch[c].users == AdlChannel::NoUser)
                 opl.NoteOff(c);
         }
     }
@@ -2270,30 +3001,23 @@ private:
 
     void NoteUpdate_All(unsigned MidCh, unsigned props_mask)
     {
-        for(MIDIchannel::activenoteiterator
-            i = Ch[MidCh].activenotes.begin();
-            i != Ch[MidCh].activenotes.end();
-            )
-        {
-            MIDIchannel::activenoteiterator j(i++);
-            NoteUpdate(MidCh, j, props_mask);
-        }
+        for(unsigned note = 0; note < 128 && Ch[MidCh].nactive; ++note)
+            if(Ch[MidCh].NoteActive(note))
+                NoteUpdate(MidCh, note, props_mask);
     }
 
     void NoteOff(unsigned MidCh, int note)
     {
-        MIDIchannel::activenoteiterator
-            i = Ch[MidCh].activenotes.find(note);
-        if(i != Ch[MidCh].activenotes.end())
+        if(Ch[MidCh].NoteActive(note))
         {
-            NoteUpdate(MidCh, i, Upd_Off);
+            NoteUpdate(MidCh, note, Upd_Off);
         }
     }
 
     void UpdateVibrato(double amount)
     {
         for(unsigned a=0, b=Ch.size(); a<b; ++a)
-            if(Ch[a].vibrato && !Ch[a].activenotes.empty())
+            if(Ch[a].vibrato && Ch[a].nactive)
             {
                 NoteUpdate_All(a, Upd_Pitch);
                 Ch[a].vibpos += amount * Ch[a].vibspeed;
@@ -2327,7 +3051,7 @@ private:
         for(unsigned c = 0; c < opl.NumChannels; ++c)
         {
         retry_arpeggio:;
-            size_t n_users = ch[c].users.size();
+            size_t n_users = ch[c].n_users;
             /*if(true)
             {
                 UI.GotoXY(64,c+1); UI.Color(2);
@@ -2338,25 +3062,27 @@ private:
             }*/
             if(n_users > 1)
             {
-                AdlChannel::users_t::const_iterator i = ch[c].users.begin();
+                unsigned i = ch[c].users;
                 size_t rate_reduction = 3;
                 if(n_users >= 3) rate_reduction = 2;
                 if(n_users >= 4) rate_reduction = 1;
-                std::advance(i, (arpeggio_counter / rate_reduction) % n_users);
-                if(i->second.sustained == false)
+                for(size_t n = (arpeggio_counter / rate_reduction) % n_users; n > 0; --n)
+                    i = UserPool[i].next;
+                const AdlChannel::User& u = UserPool[i];
+                if(u.data.sustained == false)
                 {
-                    if(i->second.kon_time_until_neglible <= 0l)
+                    if(u.data.kon_time_until_neglible <= 0l)
                     {
                         NoteUpdate(
-                            i->first.MidCh,
-                            Ch[ i->first.MidCh ].activenotes.find( i->first.note ),
+                            u.loc.MidCh,
+                            u.loc.note,
                             Upd_Off,
                             c);
                         goto retry_arpeggio;
                     }
                     NoteUpdate(
-                        i->first.MidCh,
-                        Ch[ i->first.MidCh ].activenotes.find( i->first.note ),
+                        u.loc.MidCh,
+                        u.loc.note,
                         Upd_Pitch | Upd_Volume | Upd_Pan,
                         c);
                 }
@@ -2417,6 +3143,29 @@ struct Reverb /* This reverb implementation is based on Freeverb impl. in Sox */
         void Process(size_t length,
             const std::deque<float>& input, std::vector<float>& output,
             const float feedback, const float hf_damping, const float gain)
+        {
+            switch(GetCpuLevel())
+            {
+                case CPU_AVX512: ProcessAvx512(length, input, output, feedback, hf_damping, gain); break;
+                case CPU_AVX2:   ProcessAvx2(length, input, output, feedback, hf_damping, gain); break;
+                default:         ProcessKernel(length, input, output, feedback, hf_damping, gain);
+            }
+        }
+        CPU_TARGET_AVX512 void ProcessAvx512(size_t length,
+            const std::deque<float>& input, std::vector<float>& output,
+            const float feedback, const float hf_damping, const float gain)
+        {
+            ProcessKernel(length, input, output, feedback, hf_damping, gain);
+        }
+        CPU_TARGET_AVX2 void ProcessAvx2(size_t length,
+            const std::deque<float>& input, std::vector<float>& output,
+            const float feedback, const float hf_damping, const float gain)
+        {
+            ProcessKernel(length, input, output, feedback, hf_damping, gain);
+        }
+        CPU_INLINE void ProcessKernel(size_t length,
+            const std::deque<float>& input, std::vector<float>& output,
+            const float feedback, const float hf_damping, const float gain)
         {
             for(size_t a=0; a<length; ++a)
             {
@@ -2455,9 +3204,12 @@ struct Reverb /* This reverb implementation is based on Freeverb impl. in Sox */
     {
         for(size_t i=0; i<2; ++i)
             if(!out[i].empty())
+            {
+                if(out[i].size() < length) out[i].resize(length);
                 chan[i].Process(length,
                     input_fifo,
                     out[i], feedback, hf_damping, gain);
+            }
         input_fifo.erase(input_fifo.begin(), input_fifo.begin() + length);
     }
 };
@@ -2501,6 +3253,101 @@ static struct MyReverbData
     }
 } reverb_data;
 
+/* Windowed sinc polyphase resampler, for bringing the mix of chips
+ * running at their native rate to the output rate in one go.
+ * The phases between the tabulated ones are interpolated linearly.
+ */
+struct Resampler
+{
+    static const unsigned Taps = 32, Phases = 256;
+    std::vector<float> coef;    // (Phases+1) * Taps, the last phase repeats the first one shifted
+    std::vector<float> hist[2]; // Input not consumed yet, for both sides
+    double step, pos;           // Input samples per output sample, and position in hist
+
+    void Init(double inrate, double outrate)
+    {
+        step = inrate / outrate;
+        pos  = 0;
+        // Cut off a bit below the lower Nyquist frequency
+        const double cutoff = 0.91 * (step > 1 ? 1 / step : 1.0);
+        const double beta = 8.6, pi = 3.14159265358979323846;
+        coef.resize((Phases+1) * Taps);
+        for(unsigned p=0; p<=Phases; ++p)
+        {
+            double sum = 0;
+            for(unsigned k=0; k<Taps; ++k)
+            {
+                // Distance of this tap from the point being interpolated
+                double x = (int(k) - int(Taps/2 - 1)) - p / double(Phases);
+                double w = x / (Taps/2);
+                double window = w*w < 1 ? Bessel0(beta * std::sqrt(1 - w*w)) / Bessel0(beta) : 0;
+                double sinc = x == 0 ? 1 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                sum += coef[p*Taps+k] = sinc * window;
+            }
+            for(unsigned k=0; k<Taps; ++k) coef[p*Taps+k] /= sum;
+        }
+        for(unsigned w=0; w<2; ++w) hist[w].assign(Taps/2 - 1, 0.f);
+    }
+    void Process(const int* input, unsigned long count, std::vector<int>& output)
+    {
+        for(unsigned w=0; w<2; ++w)
+        {
+            size_t base = hist[w].size();
+            hist[w].resize(base + count);
+            for(unsigned long p=0; p<count; ++p) hist[w][base+p] = input[p*2+w];
+        }
+        output.clear();
+        switch(GetCpuLevel())
+        {
+            case CPU_AVX512: FilterAvx512(output); break;
+            case CPU_AVX2:   FilterAvx2(output); break;
+            default:         FilterKernel(output);
+        }
+        // Keep what the next call still needs
+        size_t used = pos;
+        for(unsigned w=0; w<2; ++w)
+            hist[w].erase(hist[w].begin(), hist[w].begin() + used);
+        pos -= used;
+    }
+private:
+    CPU_TARGET_AVX512 void FilterAvx512(std::vector<int>& output) { FilterKernel(output); }
+    CPU_TARGET_AVX2   void FilterAvx2(std::vector<int>& output)   { FilterKernel(output); }
+    // Produce all the output the history has input for
+    CPU_INLINE void FilterKernel(std::vector<int>& output)
+    {
+        const size_t avail = hist[0].size();
+        while(size_t(pos) + Taps <= avail)
+        {
+            size_t index = pos;
+            double phase = (pos - index) * Phases;
+            unsigned ph = phase;
+            float frac = phase - ph;
+            const float* a = &coef[ph * Taps];
+            const float* b = a + Taps;
+            for(unsigned w=0; w<2; ++w)
+            {
+                const float* in = &hist[w][index];
+                float sum = 0;
+                #pragma omp simd reduction(+:sum)
+                for(unsigned k=0; k<Taps; ++k)
+                    sum += in[k] * (a[k] + frac * (b[k] - a[k]));
+                output.push_back(std::lrint(sum));
+            }
+            pos += step;
+        }
+    }
+    static double Bessel0(double x)
+    {
+        double sum = 1, term = 1;
+        for(unsigned k=1; k<32; ++k)
+        {
+            term *= (x / (2*k)) * (x / (2*k));
+            sum += term;
+        }
+        return sum;
+    }
+} resampler;
+
 static void ParseReverb(std::string_view specs)
 {
     while(!specs.empty())
@@ -2572,6 +3419,13 @@ static void ParseReverb(std::string_view specs)
         ReverbSpecs.byname.stereo_depth);
 }
 
+/* Convert a sample in 16-bit scale to int16 for the device or WAV file */
+static inline short ClampSample(float out)
+{
+    return out<-32768.f ? -32768 :
+           out>32767.f ?  32767 : out;
+}
+
 #ifdef __WIN32__
 namespace WindowsAudio
 {
@@ -2693,20 +3547,30 @@ namespace WindowsAudio
   }
 }
 #else
-static std::deque<short> AudioBuffer;
+static std::deque<float> AudioBuffer; // Final samples in 16-bit scale, not clamped yet
 static MutexType AudioBuffer_lock;
+static bool DeviceFloat = false; // SDL took float samples
 static void AdlAudioCallback(void*, Uint8* stream, int len)
 {
     SDL_LockAudio();
-    short* target = (short*) stream;
     AudioBuffer_lock.Lock();
     /*if(len != AudioBuffer.size())
         fprintf(stderr, "len=%d stereo samples, AudioBuffer has %u stereo samples",
             len/4, (unsigned) AudioBuffer.size()/2);*/
-    unsigned ate = len/2; // number of shorts
+    unsigned ate = len / (DeviceFloat ? 4 : 2); // number of samples
     if(ate > AudioBuffer.size()) ate = AudioBuffer.size();
-    for(unsigned a=0; a<ate; ++a)
-        target[a] = AudioBuffer[a];
+    if(DeviceFloat)
+    {
+        float* target = (float*) stream;
+        for(unsigned a=0; a<ate; ++a)
+            target[a] = AudioBuffer[a] * (1/32768.f);
+    }
+    else
+    {
+        short* target = (short*) stream;
+        for(unsigned a=0; a<ate; ++a)
+            target[a] = ClampSample(AudioBuffer[a]);
+    }
     AudioBuffer.erase(AudioBuffer.begin(), AudioBuffer.begin() + ate);
     //fprintf(stderr, " - remain %u\n", (unsigned) AudioBuffer.size()/2);
     AudioBuffer_lock.Unlock();
@@ -2729,14 +3593,89 @@ struct FourChars
 };
 
 
-static void SendStereoAudio(unsigned long count, int* samples)
+static void SendStereoAudio(unsigned long count, int* samples);
+
+/* Mix the dry signal with the wet sides of both reverbs, into
+ * interleaved output in 16-bit scale with the DC offset put back.
+ */
+static CPU_INLINE void MixStereoKernel(unsigned long count, const float* const dry[2],
+    const float* const wet0[2], const float* const wet1[2],
+    float wetonly, const float average[2], float* output)
 {
-    if(count > MaxSamplesAtTime)
+    for(unsigned long p = 0; p < count; ++p)
+        for(unsigned w=0; w<2; ++w)
+            output[p*2+w] = ((1 - wetonly) * dry[w][p] +
+                              wetonly * (.5 * (wet0[w][p] + wet1[w][p]))
+                            ) * 32768.0f + average[w];
+}
+static CPU_TARGET_AVX512 void MixStereoAvx512(unsigned long count, const float* const dry[2],
+    const float* const wet0[2], const float* const wet1[2],
+    float wetonly, const float average[2], float* output)
+{
+    MixStereoKernel(count, dry, wet0, wet1, wetonly, average, output);
+}
+static CPU_TARGET_AVX2 void MixStereoAvx2(unsigned long count, const float* const dry[2],
+    const float* const wet0[2], const float* const wet1[2],
+    float wetonly, const float average[2], float* output)
+{
+    MixStereoKernel(count, dry, wet0, wet1, wetonly, average, output);
+}
+static void MixStereo(unsigned long count, const float* const dry[2],
+    const float* const wet0[2], const float* const wet1[2],
+    float wetonly, const float average[2], float* output)
+{
+    switch(GetCpuLevel())
+    {
+        case CPU_AVX512: MixStereoAvx512(count, dry, wet0, wet1, wetonly, average, output); break;
+        case CPU_AVX2:   MixStereoAvx2(count, dry, wet0, wet1, wetonly, average, output); break;
+        default:         MixStereoKernel(count, dry, wet0, wet1, wetonly, average, output);
+    }
+}
+
+/* Render the ticks that were played since the last call, with
+ * the queued pokes landing on their exact sample.
+ */
+static void RenderPending(OPL3& opl, std::vector<unsigned long>& pending)
+{
+    unsigned long n_samples = opl.PokeOffset;
+    opl.PokeOffset = 0;
+    if(!n_samples) return;
+    /* Mix together the audio from different cards */
+    static std::vector<int> sample_buf;
+    sample_buf.resize(n_samples*2);
+    static std::vector<OPLChip*> chips;
+    chips.clear();
+    for(unsigned card=0; card<NumCards; ++card) chips.push_back(opl.cards[card].get());
+    GenerateChips(&chips[0], NumCards, n_samples, &sample_buf[0]);
+    if(NativeRate)
     {
-        SendStereoAudio(MaxSamplesAtTime, samples);
-        SendStereoAudio(count-MaxSamplesAtTime, samples+MaxSamplesAtTime);
+        /* Convert the mix to the output rate and process it in pieces
+         * the size of the ticks, which the DC filter depends on */
+        static std::vector<int> resampled;
+        resampler.Process(&sample_buf[0], n_samples, resampled);
+        unsigned long out_samples = resampled.size() / 2, ticked = 0, sent = 0;
+        for(size_t a=0; a<pending.size(); ++a)
+        {
+            ticked += pending[a];
+            unsigned long end = out_samples * ticked / n_samples;
+            SendStereoAudio(end - sent, &resampled[sent * 2]);
+            sent = end;
+        }
+        pending.clear();
         return;
     }
+    /* Process it in the same pieces as it was ticked */
+    int* samples = &sample_buf[0];
+    for(size_t a=0; a<pending.size(); ++a)
+    {
+        SendStereoAudio(pending[a], samples);
+        samples += pending[a] * 2;
+    }
+    pending.clear();
+}
+
+static void SendStereoAudio(unsigned long count, int* samples)
+{
 #if 0
     if(count % 2 == 1)
     {
@@ -2815,28 +3754,23 @@ static void SendStereoAudio(unsigned long count, int* samples)
     for(unsigned w=0; w<2; ++w)
         reverb_data.chan[w].Process(count);
 
-    // Convert to signed 16-bit int format and put to playback queue
+    // Mix in one contiguous piece
+    static std::vector<float> mixed;
+    mixed.resize(count*2);
+    const float* const dry_ptr[2] = { &dry[0][0], &dry[1][0] };
+    const float* const wet0[2] = { reverb_data.chan[0].out[0].data(), reverb_data.chan[0].out[1].data() };
+    const float* const wet1[2] = { reverb_data.chan[1].out[0].data(), reverb_data.chan[1].out[1].data() };
+    MixStereo(count, dry_ptr, wet0, wet1, reverb_data.wetonly, average_flt, &mixed[0]);
+
+    // Put to playback queue, conversion to the output format happens on the way out
 #ifdef __WIN32__
-    std::vector<short> AudioBuffer(count*2);
+    const std::vector<float>& AudioBuffer = mixed;
     const size_t pos = 0;
 #else
     AudioBuffer_lock.Lock();
     size_t pos = AudioBuffer.size();
-    AudioBuffer.resize(pos + count*2);
+    AudioBuffer.insert(AudioBuffer.end(), mixed.begin(), mixed.end());
 #endif
-    for(unsigned long p = 0; p < count; ++p)
-        for(unsigned w=0; w<2; ++w)
-        {
-            float out = ((1 - reverb_data.wetonly) * dry[w][p] +
-                          reverb_data.wetonly * (
-                .5 * (reverb_data.chan[0].out[w][p]
-                    + reverb_data.chan[1].out[w][p]))
-                        ) * 32768.0f
-                 + average_flt[w];
-            AudioBuffer[pos+p*2+w] =
-                out<-32768.f ? -32768 :
-                out>32767.f ?  32767 : out;
-        }
     if(WritePCMfile)
     {
         /* HACK: Cheat on DOSBox recording: Record audio separately on Windows. */
@@ -2847,14 +3781,16 @@ static void SendStereoAudio(unsigned long count, int* samples)
                                     : fopen(PCMfilepath.c_str(), "wb");
             if(fp)
             {
+                const unsigned bytes = FloatOutput ? 4 : 2;
                 FourChars Bufs[] = {
                     "RIFF", (0x24u),  // RIFF type, file length - 8
                     "WAVE",           // WAVE file
                     "fmt ", (0x10u),  // fmt subchunk, which is 16 bytes:
-                      "\1\0\2\0",     // PCM (1) & stereo (2)
-                      (48000u    ), // sampling rate
-                      (48000u*2*2), // byte rate
-                      "\2\0\20\0",    // block align & bits per sample
+                      FloatOutput ? "\3\0\2\0"  // IEEE float (3) & stereo (2)
+                                  : "\1\0\2\0", // PCM (1) & stereo (2)
+                      (unsigned(PCM_RATE)        ), // sampling rate
+                      (unsigned(PCM_RATE)*2*bytes), // byte rate
+                      FourChars(2*bytes + (8*bytes << 16)), // block align & bits per sample
                     "data", (0x00u)  //  data subchunk, which is so far 0 bytes.
                 };
                 for(unsigned c=0; c<sizeof(Bufs)/sizeof(*Bufs); ++c)
@@ -2864,8 +3800,18 @@ static void SendStereoAudio(unsigned long count, int* samples)
 
         // Using a loop, because our data type is a deque, and
         // the data might not be contiguously stored in memory.
-        for(unsigned long p = 0; p < 2*count; ++p)
-            std::fwrite(&AudioBuffer[pos+p], 1, 2, fp);
+        if(FloatOutput)
+            for(unsigned long p = 0; p < 2*count; ++p)
+            {
+                float out = AudioBuffer[pos+p] * (1/32768.f);
+                std::fwrite(&out, 1, 4, fp);
+            }
+        else
+            for(unsigned long p = 0; p < 2*count; ++p)
+            {
+                short out = ClampSample(AudioBuffer[pos+p]);
+                std::fwrite(&out, 1, 2, fp);
+            }
 
         /* Update the WAV header */
         if(true)
@@ -2934,7 +3880,13 @@ static void SendStereoAudio(unsigned long count, int* samples)
     AudioBuffer_lock.Unlock();
 #else
     if(!WritePCMfile)
-        WindowsAudio::Write( (const unsigned char*) &AudioBuffer[0], 2*AudioBuffer.size());
+    {
+        // The wave mapper is opened for 16-bit samples
+        std::vector<short> output(AudioBuffer.size());
+        for(size_t p = 0; p < output.size(); ++p)
+            output[p] = ClampSample(AudioBuffer[p]);
+        WindowsAudio::Write( (const unsigned char*) &output[0], 2*output.size());
+    }
 #endif
 }
 #endif /* not DJGPP */
@@ -3194,9 +4146,20 @@ int main(int argc, char** argv)
             " -v              Enables vibrato amplification mode\n"
             " -s              Enables scaling of modulator volumes\n"
             " -nl             Quit without looping\n"
+            " -length         Prints the length and the loop of the song and quits\n"
+            " -stats          Prints the number of OPL register writes on exit\n"
+            " -seek <seconds> Starts playing at the given time\n"
+            " -seekindex <seconds> Keeps a seek checkpoint every so many seconds\n"
 #ifndef __DJGPP__
             " -reverb <specs> Controls reverb (default: gain=6:room=.7:factor=.6:damping=.8:predelay=0:stereo=1)\n"
             " -reverb none    Disables reverb (also -nr)\n"
+            " -wave <type>    Selects the OPL wave generator: mul (default), log or handler\n"
+            " -native         Runs the OPL chips at their native rate and resamples the mix\n"
+            " -rate <hz>      Sets the output rate (default: 48000)\n"
+            " -preview        Renders at 22050 Hz for quick auditioning, about half the work\n"
+            " -float          Outputs 32-bit float samples, also into the WAV file\n"
+            " -fast           Uses the fast OPL emulation, less accurate but much lighter\n"
+            " -cpu <level>    Limits the vector kernels to generic, avx2 or avx512\n"
 #endif
             " -w [<filename>] Write WAV file rather than playing\n"
 #ifdef SUPPORT_VIDEO_OUTPUT
@@ -3240,6 +4203,20 @@ int main(int argc, char** argv)
             HighTremoloMode = true;
         else if(!std::strcmp("-nl", argv[2]))
             QuitWithoutLooping = true;
+        else if(!std::strcmp("-length", argv[2]))
+            PrintLengthOnly = true;
+        else if(!std::strcmp("-stats", argv[2]))
+            PrintWriteStats = true;
+        else if(!std::strcmp("-seek", argv[2]) && argc > 3)
+        {
+            SeekTime = std::strtod(argv[3], 0);
+            had_option = true;
+        }
+        else if(!std::strcmp("-seekindex", argv[2]) && argc > 3)
+        {
+            SeekIndexInterval = std::strtod(argv[3], 0);
+            had_option = true;
+        }
 #ifndef __DJGPP__
         else if(!std::strcmp("-nr", argv[2]))
             ParseReverb("none");
@@ -3248,6 +4225,39 @@ int main(int argc, char** argv)
             ParseReverb(argv[3]);
             had_option = true;
         }
+        else if(!std::strcmp("-wave", argv[2]) && argc > 3)
+        {
+            if(!std::strcmp("mul", argv[3]))          WaveMode = WAVE_TABLEMUL;
+            else if(!std::strcmp("log", argv[3]))     WaveMode = WAVE_TABLELOG;
+            else if(!std::strcmp("handler", argv[3])) WaveMode = WAVE_HANDLER;
+            else std::fprintf(stderr, "Unknown wave generator \"%s\", using the default\n", argv[3]);
+            had_option = true;
+        }
+        else if(!std::strcmp("-native", argv[2]))
+            NativeRate = true;
+        else if(!std::strcmp("-rate", argv[2]) && argc > 3)
+        {
+            unsigned long rate = std::strtoul(argv[3], 0, 10);
+            if(rate >= 8000 && rate <= 192000) PCM_RATE = rate;
+            else std::fprintf(stderr, "Output rate %s is not within 8000..192000, using %lu\n", argv[3], PCM_RATE);
+            had_option = true;
+        }
+        else if(!std::strcmp("-preview", argv[2]))
+            PCM_RATE = 22050;
+        else if(!std::strcmp("-float", argv[2]))
+            FloatOutput = true;
+        else if(!std::strcmp("-fast", argv[2]))
+            Quality = DBOPL_QUALITY_FAST;
+        else if(!std::strcmp("-cpu", argv[2]) && argc > 3)
+        {
+            unsigned level = 0;
+            while(level < 3 && std::strcmp(CpuLevelNames[level], argv[3])) ++level;
+            if(level == 3)
+                std::fprintf(stderr, "Unknown cpu level \"%s\"\n", argv[3]);
+            else if(SetCpuLevel((CpuLevel)level) != (CpuLevel)level)
+                std::fprintf(stderr, "This cpu can't run %s, using %s\n", argv[3], CpuLevelNames[GetCpuLevel()]);
+            had_option = true;
+        }
 #endif
         else if(!std::strcmp("-w", argv[2]))
         {
@@ -3294,14 +4304,16 @@ int main(int argc, char** argv)
 
 #ifndef __DJGPP__
 
+    ChipRate = NativeRate ? DBOPL_NATIVE_RATE : PCM_RATE;
+
 #ifndef __WIN32__
     static SDL_AudioSpec spec, obtained;
     spec.freq     = PCM_RATE;
-    spec.format   = AUDIO_S16SYS;
+    spec.format   = FloatOutput ? AUDIO_F32SYS : AUDIO_S16SYS;
     spec.channels = 2;
     spec.samples  = spec.freq * AudioBufferLength;
     spec.callback = AdlAudioCallback;
-    if (!WritePCMfile)
+    if (!WritePCMfile && !PrintLengthOnly)
     {
         // Set up SDL
         if(SDL_OpenAudio(&spec, &obtained) < 0)
@@ -3313,6 +4325,7 @@ int main(int argc, char** argv)
             std::fprintf(stderr, "Wanted (samples=%u,rate=%u,channels=%u); obtained (samples=%u,rate=%u,channels=%u)\n",
                 spec.samples,    spec.freq,    spec.channels,
                 obtained.samples,obtained.freq,obtained.channels);
+        DeviceFloat = obtained.format == AUDIO_F32SYS;
     }
 #endif
 
@@ -3403,6 +4416,13 @@ int main(int argc, char** argv)
         UI.ShowCursor();
         return 2;
     }
+    if(PrintLengthOnly)
+    {
+        std::printf("%s: length %.3f s, loop %.3f s - %.3f s\n", argv[1],
+            player.SongLength, player.LoopStartTime, player.LoopEndTime);
+        UI.ShowCursor();
+        return 0;
+    }
 
     if(n_fourop[0] >= n_total[0]*15/16 && NumFourOps == 0)
     {
@@ -3412,6 +4432,10 @@ int main(int argc, char** argv)
             "       not what you want, therefore ignoring the request.\n");
         return 0;
     }
+    if(SeekIndexInterval > 0.0)
+        player.BuildSeekIndex(SeekIndexInterval);
+    if(SeekTime > 0.0)
+        player.Seek(SeekTime);
 
 #ifdef __DJGPP__
 
@@ -3427,7 +4451,14 @@ int main(int argc, char** argv)
 
     const double mindelay = 1 / (double)PCM_RATE;
     const double maxdelay = MaxSamplesAtTime / (double)PCM_RATE;
+    // When writing a file, the pokes of many ticks are queued at their
+    // sample positions and rendered in one go
+    const unsigned long RenderAhead = WritePCMfile ? MaxSamplesQueued : 0;
+    std::vector<unsigned long> pending; // Lengths of the ticks not rendered yet
     reverb_data.ReInit();
+    if(NativeRate) resampler.Init(DBOPL_NATIVE_CLOCK, PCM_RATE);
+    // The ticks are counted in samples of the chips
+    const double chip_rate = NativeRate ? DBOPL_NATIVE_CLOCK : PCM_RATE;
 
 #ifdef __WIN32
     WindowsAudio::Open(PCM_RATE, 2, 16);
@@ -3447,7 +4478,7 @@ int main(int argc, char** argv)
         delay -= eat_delay;
 
         static double carry = 0.0;
-        carry += PCM_RATE * eat_delay;
+        carry += chip_rate * eat_delay;
         const unsigned long n_samples = (unsigned) carry;
         carry -= n_samples;
 
@@ -3455,34 +4486,13 @@ int main(int argc, char** argv)
             SkipForward -= 1;
         else
         {
-            if(NumCards == 1)
-            {
-                player.opl.cards[0].Generate(0, SendStereoAudio, n_samples);
-            }
+            if(n_samples > 0)
+                pending.push_back(n_samples);
+            player.opl.PokeOffset += n_samples;
+            if(player.opl.PokeOffset > RenderAhead)
+                RenderPending(player.opl, pending);
             else if(n_samples > 0)
-            {
-                /* Mix together the audio from different cards */
-                static std::vector<int> sample_buf;
-                sample_buf.clear();
-                sample_buf.resize(n_samples*2);
-                struct Mix
-                {
-                    static void AddStereoAudio(unsigned long count, int* samples)
-                    {
-                        for(unsigned long a=0; a<count*2; ++a)
-                            sample_buf[a] += samples[a];
-                    }
-                };
-                for(unsigned card = 0; card < NumCards; ++card)
-                {
-                    player.opl.cards[card].Generate(
-                        0,
-                        Mix::AddStereoAudio,
-                        n_samples);
-                }
-                /* Process it */
-                SendStereoAudio(n_samples, &sample_buf[0]);
-            }
+                player.opl.SplitRender();
 
             //fprintf(stderr, "Enter: %u (%.2f ms)\n", (unsigned)AudioBuffer.size(),
             //    AudioBuffer.size() * .5e3 / obtained.freq);
@@ -3549,6 +4559,8 @@ int main(int argc, char** argv)
 
 #else
 
+    RenderPending(player.opl, pending);
+
 #ifdef __WIN32__
     WindowsAudio::Close();
 #else
@@ -3556,6 +4568,9 @@ int main(int argc, char** argv)
 #endif
 
 #endif /* djgpp */
+    if(PrintWriteStats)
+        std::fprintf(stderr, "%lu register writes issued, %lu redundant ones suppressed\n",
+            player.opl.PokesIssued, player.opl.PokesSuppressed);
     if(FakeDOSshell)
     {
         fprintf(stderr,
@@ -20,11 +20,15 @@ TARGET = adlmidi
 SOURCES += \
     adldata.cc \
     dbopl.cpp \
-    midiplay.cc
+    midiplay.cc \
+    oplchip.cc
 
 HEADERS += \
     adldata.hh \
+    cpulevel.h \
     dbopl.h \
+    oplchip.h \
+    dbopltables.inc \
     fraction \
     puzzlegame.inc \
     6x9.inc \
@@ -0,0 +1,143 @@
+#include <cstring>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include "oplchip.h"
+#include "dbopl.h"
+
+OPLChipOptions::OPLChipOptions()
+    : waveMode(DBOPL_WAVE), quality(DBOPL_QUALITY_EXACT),
+      channelThreads(1), channelGroups(true)
+{
+}
+
+namespace
+{
+    class DBOPLChip : public OPLChip
+    {
+        DBOPL::Handler handler;
+        OPLChipOptions options;
+    public:
+        explicit DBOPLChip(const OPLChipOptions& o) : options(o)
+        {
+            Reset(44100);
+        }
+        const char* Name() const
+        {
+            return "dbopl";
+        }
+        DBOPL::Handler* GetHandler()
+        {
+            return &handler;
+        }
+        void Reset(unsigned long rate)
+        {
+            handler.Init(rate, options.waveMode, options.quality);
+            handler.SetChannelGroups(options.channelGroups);
+            handler.SetChannelThreads(options.channelThreads);
+        }
+        void WriteReg(unsigned reg, unsigned char value)
+        {
+            handler.WriteReg(reg, value);
+        }
+        void QueueReg(unsigned long offset, unsigned reg, unsigned char value)
+        {
+            handler.QueueReg(offset, reg, value);
+        }
+        void QueueSplit(unsigned long offset)
+        {
+            handler.QueueSplit(offset);
+        }
+        void Generate(int* output, unsigned long frames, bool accumulate)
+        {
+            handler.Generate(output, frames, accumulate);
+        }
+        void SaveState(std::vector<unsigned char>& state) const
+        {
+            handler.SaveState(state);
+        }
+        size_t RestoreState(const unsigned char* state, size_t size)
+        {
+            return handler.RestoreState(state, size);
+        }
+    };
+}
+
+OPLChip* CreateOPLChip(const char* backend, const OPLChipOptions& options)
+{
+    if(!std::strcmp(backend, "dbopl")) return new DBOPLChip(options);
+    return 0;
+}
+
+// Render a run of chips into output, which is overwritten. The DBOPL
+// chips go through DBOPL::GenerateMulti to share the grouped kernel.
+static void GenerateRun(OPLChip* const* chips, unsigned count, unsigned long frames, int* output)
+{
+    static thread_local std::vector<DBOPL::Handler*> handlers;
+    handlers.clear();
+    for(unsigned c = 0; c < count; ++c)
+        if(!std::strcmp(chips[c]->Name(), "dbopl"))
+            handlers.push_back(static_cast<DBOPLChip*>(chips[c])->GetHandler());
+    DBOPL::GenerateMulti(handlers.empty() ? 0 : &handlers[0], handlers.size(), frames, output);
+    for(unsigned c = 0; c < count; ++c)
+        if(std::strcmp(chips[c]->Name(), "dbopl"))
+            chips[c]->Generate(output, frames, true);
+}
+
+#ifdef _OPENMP
+// Every thread renders a run of chips into its own buffer, and the
+// buffers are then added up in pairs by all threads together.
+static void GenerateThreaded(OPLChip* const* chips, unsigned count, unsigned threads,
+                             unsigned long frames, int* output)
+{
+    // The threads of the OpenMP pool stay around and so do their buffers
+    static thread_local std::vector<int> buffer;
+    std::vector<int*> mix(threads);
+    const unsigned long length = frames * 2;
+    #pragma omp parallel num_threads(threads)
+    {
+        // The runtime is allowed to hand out fewer threads than asked for
+        unsigned used = omp_get_num_threads();
+        unsigned t = omp_get_thread_num();
+        unsigned first = count * t / used, last = count * (t + 1) / used;
+        int* out = output;
+        if(t)
+        {
+            if(buffer.size() < length) buffer.resize(length);
+            out = &buffer[0];
+        }
+        mix[t] = out;
+        GenerateRun(chips + first, last - first, frames, out);
+        #pragma omp barrier
+        for(unsigned step = 1; step < used; step *= 2)
+            for(unsigned b = 0; b + step < used; b += step * 2)
+            {
+                int* dst = mix[b];
+                const int* src = mix[b + step];
+                #pragma omp for simd schedule(static)
+                for(unsigned long i = 0; i < length; ++i)
+                    dst[i] += src[i];
+            }
+    }
+}
+#endif
+
+void GenerateChips(OPLChip* const* chips, unsigned count, unsigned long frames, int* output)
+{
+    if(!count)
+    {
+        std::memset(output, 0, frames * 2 * sizeof(int));
+        return;
+    }
+#ifdef _OPENMP
+    unsigned threads = omp_get_max_threads();
+    if(threads > count) threads = count;
+    if(threads > 1 && !omp_in_parallel())
+    {
+        GenerateThreaded(chips, count, threads, frames, output);
+        return;
+    }
+#endif
+    GenerateRun(chips, count, frames, output);
+}
@@ -0,0 +1,59 @@
+#ifndef ADLMIDI_OPLCHIP_H
+#define ADLMIDI_OPLCHIP_H
+
+/* The player talks to its OPL3 emulators through OPLChip, and makes
+ * them by name with CreateOPLChip. There is one backend for now:
+ *
+ *     dbopl  DOSBox's emulator, with its wave modes and quality tiers
+ *
+ * Output is interleaved stereo at the rate given to Reset, in the
+ * range of DBOPL: a single full volume operator peaks near 4096.
+ */
+
+#include <vector>
+#include <cstddef>
+
+class OPLChip
+{
+public:
+    virtual ~OPLChip() { }
+    virtual const char* Name() const = 0;
+    // Clear every register and start over at the given sample rate
+    virtual void Reset(unsigned long rate) = 0;
+    virtual void WriteReg(unsigned reg, unsigned char value) = 0;
+    // Write a register right before the frame at offset in the next
+    // Generate call. Offsets lower than the ones queued are moved up,
+    // writes past the end of a Generate move on to the next one.
+    virtual void QueueReg(unsigned long offset, unsigned reg, unsigned char value) = 0;
+    // Start a new render block at offset in the next Generate call, so
+    // that it renders exactly like separate Generate calls split there
+    virtual void QueueSplit(unsigned long offset) = 0;
+    // Render frames into output, adding to it with accumulate
+    virtual void Generate(int* output, unsigned long frames, bool accumulate) = 0;
+    // Append a snapshot of the chip and its queued writes to state
+    virtual void SaveState(std::vector<unsigned char>& state) const = 0;
+    // Restore a snapshot of the same backend, returns the bytes used or 0
+    // when it doesn't fit, the chip is left alone then
+    virtual size_t RestoreState(const unsigned char* state, size_t size) = 0;
+};
+
+// Settings of the backends, each one looks only at its own
+struct OPLChipOptions
+{
+    unsigned waveMode;       // DBOPL wave generator routine
+    unsigned quality;        // DBOPL quality tier
+    unsigned channelThreads; // DBOPL threads for the channels of one chip, 0 = all
+    bool     channelGroups;  // DBOPL grouped two-operator kernel
+
+    OPLChipOptions();
+};
+
+// Returns 0 for an unknown backend name
+OPLChip* CreateOPLChip(const char* backend, const OPLChipOptions& options = OPLChipOptions());
+
+// Render frames on count chips and mix them into output, which is
+// overwritten. The chips are spread over the OpenMP threads, the DBOPL
+// chips on a thread render their 2 operator channels together.
+void GenerateChips(OPLChip* const* chips, unsigned count, unsigned long frames, int* output);
+
+#endif
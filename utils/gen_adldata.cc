@@ -1061,18 +1061,6 @@ void LoadEA(const char* fn, unsigned bank, const char* prefix)
 
 #include "dbopl.h"
 
-std::vector<int> sampleBuf;
-static void AddMonoAudio(unsigned long count, int* samples)
-{
-    sampleBuf.insert(sampleBuf.end(), samples, samples+count);
-}
-
-static void AddStereoAudio(unsigned long count, int* samples)
-{
-    for (unsigned long i = 0; i < count; i++)
-        sampleBuf.insert(sampleBuf.end(), samples + i * 2, samples + i * 2 + 1);
-}
-
 struct DurationInfo
 {
     long ms_sound_kon;
@@ -1100,6 +1088,9 @@ static DurationInfo MeasureDurations(const ins& in)
       : in.notenum >= 128 ? (44 + 128 - in.notenum)
       : in.notenum;
 
+    // Interleaved stereo, only the left side is measured
+    std::vector<int> sampleBuf(samples_per_interval * 2);
+
     DBOPL::Handler opl;
     static const short initdata[(2+3+2+2)*2] =
     { 0x004,96, 0x004,128,        // Pulse timer
@@ -1151,21 +1142,17 @@ static DurationInfo MeasureDurations(const ins& in)
     double highest_sofar = 0;
     for(unsigned period=0; period<max_on*interval; ++period)
     {
-        sampleBuf.clear();
-        unsigned n = samples_per_interval;
-        while(n > 512)
-            {opl.Generate(AddMonoAudio, AddStereoAudio, 512); n-=512;}
-        if(n)opl.Generate(AddMonoAudio, AddStereoAudio, n);
-        unsigned long count = sampleBuf.size();
+        opl.Generate(&sampleBuf[0], samples_per_interval, false);
+        unsigned long count = samples_per_interval;
 
         double mean = 0.0;
         for(unsigned long c=0; c<count; ++c)
-            mean += sampleBuf[c];
+            mean += sampleBuf[c*2];
         mean /= count;
         double std_deviation = 0;
         for(unsigned long c=0; c<count; ++c)
         {
-            double diff = (sampleBuf[c]-mean);
+            double diff = (sampleBuf[c*2]-mean);
             std_deviation += diff*diff;
         }
         std_deviation = std::sqrt(std_deviation / count);
@@ -1185,21 +1172,17 @@ static DurationInfo MeasureDurations(const ins& in)
     std::vector<double> amplitudecurve_off;
     for(unsigned period=0; period<max_off*interval; ++period)
     {
-        sampleBuf.clear();
-        unsigned n = samples_per_interval;
-        while(n > 512)
-            {opl.Generate(AddMonoAudio, AddStereoAudio, 512); n-=512;}
-        if(n)opl.Generate(AddMonoAudio, AddStereoAudio, n);
-        unsigned long count = sampleBuf.size();
+        opl.Generate(&sampleBuf[0], samples_per_interval, false);
+        unsigned long count = samples_per_interval;
 
         double mean = 0.0;
         for(unsigned long c=0; c<count; ++c)
-            mean += sampleBuf[c];
+            mean += sampleBuf[c*2];
         mean /= count;
         double std_deviation = 0;
         for(unsigned long c=0; c<count; ++c)
         {
-            double diff = (sampleBuf[c]-mean);
+            double diff = (sampleBuf[c*2]-mean);
             std_deviation += diff*diff;
         }
         std_deviation = std::sqrt(std_deviation / count);
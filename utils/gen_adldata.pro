@@ -3,6 +3,9 @@ CONFIG -= qt
 CONFIG += console
 CONFIG += c++11
 
+# For the simd loops in dbopl.cpp
+QMAKE_CXXFLAGS += -fopenmp-simd
+
 TARGET = gen_adldata
 
 INCLUDEPATH += $$PWD/../src
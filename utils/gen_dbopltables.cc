@@ -0,0 +1,113 @@
+#include <cstdio>
+#include <cmath>
+
+/* Prints the lookup tables of DBOPL that need floating point math,
+ * so they can be compiled into read-only data. The output is
+ * src/dbopltables.inc:
+ *
+ *     gen_dbopltables > src/dbopltables.inc
+ *
+ * The formulas are the ones DBOPL used to run at startup.
+ */
+
+static const double PI = 3.14159265358979323846;
+static const int MUL_SH = 16; // Same as in dbopl.cpp
+
+static void Print(const char* comment, const char* decl, const int* data, unsigned count)
+{
+    std::printf("//%s\n%s = {", comment, decl);
+    for(unsigned a=0; a<count; ++a)
+        std::printf("%s%d,", a%16 ? " " : "\n\t", data[a]);
+    std::printf("\n};\n\n");
+}
+
+// The silence gaps and the pieces made out of other pieces
+static void FillWaveTable(int* table)
+{
+    for(int i=0; i<256; ++i)
+    {
+        table[0x400 + i] = table[0];
+        table[0x500 + i] = table[0];
+        table[0x900 + i] = table[0];
+        table[0xc00 + i] = table[0];
+        table[0xd00 + i] = table[0];
+        table[0x800 + i] = table[0x200 + i];
+        table[0xa00 + i] = table[0x200 + i * 2];
+        table[0xb00 + i] = table[0x000 + i * 2];
+        table[0xe00 + i] = table[0x200 + i * 2];
+        table[0xf00 + i] = table[0x200 + i * 2];
+    }
+}
+
+int main()
+{
+    static int ExpTable[256], SinTable[512], MulTable[384];
+    static int WaveTableMul[8*512], WaveTableLog[8*512], WaveTableFast[8*128];
+
+    for(int i=0; i<256; ++i)
+    {
+        // Saved in reverse, and preshifted to the left once so
+        // the final volume can shift to the right
+        ExpTable[i] = (int)( 0.5 + ( std::pow(2.0, ( 255 - i) * ( 1.0 /256 ) )-1) * 1024 );
+        ExpTable[i] += 1024;
+        ExpTable[i] *= 2;
+    }
+    for(int i=0; i<512; ++i)
+        SinTable[i] = (short)( 0.5 - std::log10( std::sin( (i + 0.5) * (PI / 512.0) ) ) / std::log10(2.0)*256 );
+    for(int i=0; i<384; ++i)
+    {
+        int s = i * 8;
+        double val = ( 0.5 + ( std::pow(2.0, -1.0 + ( 255 - s) * ( 1.0 /256 ) )) * ( 1 << MUL_SH ));
+        MulTable[i] = (unsigned short)(val);
+    }
+
+    for(int i=0; i<512; ++i)
+    {
+        WaveTableMul[0x200 + i] = (short)(std::sin( (i + 0.5) * (PI / 512.0) ) * 4084);
+        WaveTableMul[0x000 + i] = -WaveTableMul[0x200 + i];
+    }
+    for(int i=0; i<256; ++i)
+    {
+        WaveTableMul[0x700 + i] = (short)( 0.5 + ( std::pow(2.0, -1.0 + ( 255 - i * 8) * ( 1.0 /256 ) ) ) * 4085 );
+        WaveTableMul[0x6ff - i] = -WaveTableMul[0x700 + i];
+    }
+    FillWaveTable(WaveTableMul);
+
+    for(int i=0; i<512; ++i)
+    {
+        WaveTableLog[0x200 + i] = (short)( 0.5 - std::log10( std::sin( (i + 0.5) * (PI / 512.0) ) ) / std::log10(2.0)*256 );
+        WaveTableLog[0x000 + i] = (short)(0x8000 | WaveTableLog[0x200 + i]);
+    }
+    for(int i=0; i<256; ++i)
+    {
+        WaveTableLog[0x700 + i] = i * 8;
+        WaveTableLog[0x6ff - i] = (short)(0x8000 | i * 8);
+    }
+    FillWaveTable(WaveTableLog);
+
+    // Every entry of the coarse table averages 4 neighbours of the linear one
+    for(int i=0; i<8*128; ++i)
+    {
+        int sum = WaveTableMul[i*4] + WaveTableMul[i*4+1] + WaveTableMul[i*4+2] + WaveTableMul[i*4+3];
+        WaveTableFast[i] = sum >= 0 ? (sum + 2) / 4 : -((2 - sum) / 4);
+    }
+
+    std::printf("//Generated by utils/gen_dbopltables.cc, do not edit\n\n");
+    Print("Exponential volume table used by WAVE_HANDLER and WAVE_TABLELOG",
+          "static const Bit16u ExpTable[ 256 ]", ExpTable, 256);
+    Print("PI table used by WAVEHANDLER",
+          "static const Bit16u SinTable[ 512 ]", SinTable, 512);
+    Print("Volume multipliers for WAVE_TABLEMUL",
+          "static const Bit16u MulTable[ 384 ]", MulTable, 384);
+    Print("Linear table for WAVE_TABLEMUL",
+          "static const Bit16s WaveTableMul[ 8 * 512 ]", WaveTableMul, 8*512);
+    Print("Logarithmic table for WAVE_TABLELOG",
+          "static const Bit16s WaveTableLog[ 8 * 512 ]", WaveTableLog, 8*512);
+    Print("32 bit copy of WaveTableMul, the grouped kernel can gather from it",
+          "static const Bit32s WaveTable32[ 8 * 512 ]", WaveTableMul, 8*512);
+    Print("Linear table at a quarter of the resolution for the fast quality",
+          "static const Bit16s WaveTableFast[ 8 * 128 ]", WaveTableFast, 8*128);
+    Print("32 bit copy of WaveTableFast for the grouped kernel",
+          "static const Bit32s WaveTableFast32[ 8 * 128 ]", WaveTableFast, 8*128);
+    return 0;
+}
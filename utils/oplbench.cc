@@ -0,0 +1,319 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <memory>
+
+#include "dbopl.h"
+#include "oplchip.h"
+#include "cpulevel.h"
+
+/* Replays the same register stream through every wave generator
+ * routine and quality tier of DBOPL, and reports the speed of each one
+ * and how far its output strays from the multiplication tables (the
+ * default, exact quality). Then times the mixing of several cards
+ * with GenerateChips against rendering and adding them one at a time.
+ */
+
+struct RegWrite
+{
+    unsigned delay; // Samples to render before this write
+    unsigned reg;
+    unsigned char value;
+};
+
+static unsigned long rand_state = 1;
+static unsigned Rand(unsigned n)
+{
+    rand_state = rand_state * 1103515245ul + 12345ul;
+    return ((rand_state >> 8) & 0xFFFFFF) % n;
+}
+
+static const unsigned Operators[9] = {0x00,0x01,0x02, 0x08,0x09,0x0A, 0x10,0x11,0x12};
+
+static void Patch(std::vector<RegWrite>& script, unsigned chan)
+{
+    unsigned hi = chan >= 9 ? 0x100 : 0, c = chan % 9;
+    for(unsigned op=0; op<2; ++op)
+    {
+        unsigned o = hi + Operators[c] + op*3;
+        bool carrier = op == 1;
+        script.push_back( {0, 0x20+o, (unsigned char)(Rand(4)*0x40 + 0x20 + Rand(4))} );
+        script.push_back( {0, 0x40+o, (unsigned char)(carrier ? Rand(12) : 8+Rand(32))} );
+        script.push_back( {0, 0x60+o, (unsigned char)(0x80 + Rand(0x80))} );
+        script.push_back( {0, 0x80+o, (unsigned char)Rand(256)} );
+        script.push_back( {0, 0xE0+o, (unsigned char)Rand(8)} );
+    }
+    script.push_back( {0, hi+0xC0+c, (unsigned char)(0x30 + Rand(16))} );
+}
+
+static std::vector<RegWrite> MakeScript(unsigned rate, unsigned seconds, bool rhythm = true)
+{
+    std::vector<RegWrite> script;
+    script.push_back( {0, 0x105, 1} );
+    script.push_back( {0, 0x001, 0x20} );
+    script.push_back( {0, 0x104, 0x03} ); // Two four-op pairs
+    for(unsigned c=0; c<18; ++c) Patch(script, c);
+
+    unsigned keyon[18] = { 0 };
+    unsigned long total = (unsigned long)rate * seconds, pos = 0;
+    unsigned delay = 0;
+    while(pos < total)
+    {
+        unsigned c = Rand(18), hi = c >= 9 ? 0x100 : 0;
+        switch(Rand(8))
+        {
+            case 0:
+                Patch(script, c);
+                break;
+            case 1:
+                // Rhythm mode in the second half, with random drum hits
+                if(rhythm && pos > total/2)
+                    script.push_back( {delay, 0xBD, (unsigned char)(0xE0 | Rand(32))} );
+                break;
+            default:
+                if(keyon[c])
+                    script.push_back( {delay, hi+0xB0+c%9, (unsigned char)(keyon[c] & 0x1F)} );
+                keyon[c] = 0x20 | (1 + Rand(6)) << 2 | Rand(4);
+                script.push_back( {delay, hi+0xA0+c%9, (unsigned char)Rand(256)} );
+                script.push_back( {0, hi+0xB0+c%9, (unsigned char)keyon[c]} );
+        }
+        delay = rate/1000 + Rand(rate/20);
+        pos += delay;
+    }
+    script.push_back( {delay, 0xBD, 0} );
+    return script;
+}
+
+static void Render(const std::vector<RegWrite>& script, unsigned rate,
+                   const char* backend, const OPLChipOptions& options,
+                   std::vector<int>& out)
+{
+    std::unique_ptr<OPLChip> opl(CreateOPLChip(backend, options));
+    opl->Reset(rate);
+    out.clear();
+    for(size_t a=0; a<script.size(); ++a)
+    {
+        size_t pos = out.size();
+        out.resize(pos + script[a].delay*2);
+        // Stay in blocks of 512 like the players do, the output depends on it
+        for(unsigned done=0; done<script[a].delay; done += 512)
+        {
+            unsigned n = script[a].delay - done;
+            if(n > 512) n = 512;
+            opl->Generate(&out[pos + done*2], n, false);
+        }
+        opl->WriteReg(script[a].reg, script[a].value);
+    }
+}
+
+/* Plays a script per card in blocks of 512 like midiplay does, with
+ * the writes of each block queued on their sample, and mixes the cards
+ * with GenerateChips, one card at a time through a scratch buffer the
+ * way the players did it before GenerateChips, or one card at a time
+ * mixing straight into the output.
+ */
+enum CardMixing { MixScratch, MixEach, MixChips };
+
+static void RenderCards(const std::vector< std::vector<RegWrite> >& scripts, unsigned rate,
+                        unsigned long length, CardMixing mixing, std::vector<int>& out)
+{
+    const unsigned count = scripts.size();
+    std::vector< std::unique_ptr<OPLChip> > opl(count);
+    std::vector<OPLChip*> chips(count);
+    std::vector<size_t> next(count, 0);
+    std::vector<unsigned long> when(count, 0);
+    for(unsigned c=0; c<count; ++c)
+    {
+        opl[c].reset(CreateOPLChip("dbopl"));
+        opl[c]->Reset(rate);
+        chips[c] = opl[c].get();
+    }
+    std::vector<int> scratch(512*2);
+    out.assign(length*2, 0);
+    for(unsigned long pos=0; pos<length; pos += 512)
+    {
+        unsigned n = length - pos < 512 ? length - pos : 512;
+        for(unsigned c=0; c<count; ++c)
+            for(; next[c] < scripts[c].size(); ++next[c])
+            {
+                unsigned long at = when[c] + scripts[c][next[c]].delay;
+                if(at >= pos + n) break;
+                when[c] = at;
+                chips[c]->QueueReg(at - pos, scripts[c][next[c]].reg, scripts[c][next[c]].value);
+            }
+        if(mixing == MixChips)
+        {
+            GenerateChips(&chips[0], count, n, &out[pos*2]);
+            continue;
+        }
+        if(mixing == MixEach)
+        {
+            for(unsigned c=0; c<count; ++c)
+                chips[c]->Generate(&out[pos*2], n, true);
+            continue;
+        }
+        for(unsigned c=0; c<count; ++c)
+        {
+            chips[c]->Generate(&scratch[0], n, false);
+            for(unsigned a=0; a<n*2; ++a)
+                out[pos*2 + a] += scratch[a];
+        }
+    }
+}
+
+/* Replays the script up to its middle with the writes of the next few
+ * thousand samples queued, and takes a snapshot. A chip set up at another rate restores
+ * it and renders the rest, which has to match the reference exactly.
+ * A cut off snapshot has to be refused.
+ */
+static bool CheckState(const std::vector<RegWrite>& script, unsigned rate,
+                       const std::vector<int>& reference)
+{
+    std::unique_ptr<OPLChip> opl(CreateOPLChip("dbopl")), copy(CreateOPLChip("dbopl"));
+    opl->Reset(rate);
+    copy->Reset(rate / 2);
+    size_t half = script.size() / 2, pos = 0;
+    for(size_t a=0; a<half; ++a)
+    {
+        for(unsigned done=0; done<script[a].delay; done += 512)
+        {
+            unsigned n = script[a].delay - done;
+            if(n > 512) n = 512;
+            std::vector<int> out(n*2);
+            opl->Generate(&out[0], n, false);
+        }
+        pos += script[a].delay*2;
+        opl->WriteReg(script[a].reg, script[a].value);
+    }
+    size_t queued = half;
+    for(unsigned long offset = 0; queued < script.size() && offset < 4096; ++queued)
+    {
+        offset += script[queued].delay;
+        opl->QueueReg(offset, script[queued].reg, script[queued].value);
+    }
+    std::vector<unsigned char> state;
+    opl->SaveState(state);
+    if(copy->RestoreState(&state[0], state.size()-1) || copy->RestoreState(&state[0], state.size()) != state.size())
+        return false;
+    std::vector<int> out(reference.size() - pos);
+    for(size_t a=half, outpos=0; a<script.size(); ++a)
+    {
+        for(unsigned done=0; done<script[a].delay; done += 512)
+        {
+            unsigned n = script[a].delay - done;
+            if(n > 512) n = 512;
+            copy->Generate(&out[outpos + done*2], n, false);
+        }
+        outpos += script[a].delay*2;
+        if(a >= queued)
+            copy->WriteReg(script[a].reg, script[a].value);
+    }
+    return std::equal(out.begin(), out.end(), reference.begin() + pos);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seconds = argc > 1 ? std::atoi(argv[1]) : 30;
+    unsigned rate    = argc > 2 ? std::atoi(argv[2]) : 48000;
+    unsigned repeat  = argc > 3 ? std::atoi(argv[3]) : 3;
+    if(!seconds || !rate || !repeat)
+    {
+        std::fprintf(stderr, "Usage: oplbench [<seconds> [<rate> [<repeats>]]]\n");
+        return 1;
+    }
+
+    // Threads 0 splits the channels over all OpenMP threads
+    static const struct { const char* name; const char* backend; unsigned mode, quality; bool groups; unsigned threads; } modes[] =
+    {
+        { "tablemul",         "dbopl", WAVE_TABLEMUL, DBOPL_QUALITY_EXACT, true,  1 },
+        { "tablemul-ungroup", "dbopl", WAVE_TABLEMUL, DBOPL_QUALITY_EXACT, false, 1 },
+        { "tablemul-threads", "dbopl", WAVE_TABLEMUL, DBOPL_QUALITY_EXACT, true,  0 },
+        { "tablelog",         "dbopl", WAVE_TABLELOG, DBOPL_QUALITY_EXACT, false, 1 },
+        { "handler",          "dbopl", WAVE_HANDLER,  DBOPL_QUALITY_EXACT, false, 1 },
+        { "fast",             "dbopl", WAVE_TABLEMUL, DBOPL_QUALITY_FAST,  true,  1 },
+        { "fast-ungroup",     "dbopl", WAVE_TABLEMUL, DBOPL_QUALITY_FAST,  false, 1 },
+    };
+
+    std::vector<RegWrite> script = MakeScript(rate, seconds);
+    std::vector<int> reference, out;
+    double reftime = 0;
+
+    std::printf("%u seconds at %u Hz, %u register writes, best of %u, %s kernels\n",
+        seconds, rate, (unsigned)script.size(), repeat, CpuLevelNames[GetCpuLevel()]);
+    std::printf("%-17s %14s %9s %8s %9s %9s %8s\n",
+        "routine", "samples/sec", "realtime", "cpu", "max dev", "rms dev", "snr dB");
+    for(unsigned m=0; m<sizeof(modes)/sizeof(*modes); ++m)
+    {
+        double best = 1e30;
+        for(unsigned r=0; r<repeat; ++r)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            OPLChipOptions options;
+            options.waveMode       = modes[m].mode;
+            options.quality        = modes[m].quality;
+            options.channelGroups  = modes[m].groups;
+            options.channelThreads = modes[m].threads;
+            Render(script, rate, modes[m].backend, options, out);
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - begin;
+            if(t.count() < best) best = t.count();
+        }
+        if(!m)
+        {
+            reference = out;
+            reftime = best;
+        }
+
+        long maxdev = 0;
+        double dev = 0, sig = 0;
+        for(size_t a=0; a<out.size(); ++a)
+        {
+            long d = std::labs((long)out[a] - reference[a]);
+            if(d > maxdev) maxdev = d;
+            dev += (double)d*d;
+            sig += (double)reference[a]*reference[a];
+        }
+        size_t n = out.size() ? out.size() : 1;
+        double samples = out.size() / 2;
+        // Cpu time relative to the reference, lower is better
+        std::printf("%-17s %14.0f %8.1fx %7.0f%% %9ld %9.2f ",
+            modes[m].name, samples/best, samples/rate/best, 100*best/reftime,
+            maxdev, std::sqrt(dev/n));
+        if(dev > 0)
+            std::printf("%8.1f\n", 10*std::log10(sig/dev));
+        else
+            std::printf("%8s\n", "exact");
+    }
+    std::printf("snapshot restore: %s\n", CheckState(script, rate, reference) ? "exact" : "DIFFERS");
+
+    // Melodic streams like midiplay sends without -p, with rhythm mode the
+    // noise generator of every card takes most of the time
+    static const unsigned Cards = 24;
+    std::vector< std::vector<RegWrite> > scripts(Cards);
+    for(unsigned c=0; c<Cards; ++c) scripts[c] = MakeScript(rate, seconds, false);
+    std::printf("\n%u cards, each with its own melodic register stream\n", Cards);
+    std::printf("%-17s %14s %9s %8s %9s\n", "mixing", "samples/sec", "realtime", "cpu", "output");
+    static const char* const mixings[] = { "one by one", "each into output", "GenerateChips" };
+    std::vector<int> cardout[3];
+    double best[3] = { 1e30, 1e30, 1e30 };
+    // The mixings take turns, so a slow moment of the machine doesn't favour one
+    for(unsigned r=0; r<repeat; ++r)
+        for(unsigned m=0; m<3; ++m)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            RenderCards(scripts, rate, reference.size() / 2, (CardMixing)m, cardout[m]);
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - begin;
+            if(t.count() < best[m]) best[m] = t.count();
+        }
+    for(unsigned m=0; m<3; ++m)
+    {
+        double samples = cardout[m].size() / 2;
+        std::printf("%-17s %14.0f %8.1fx %7.0f%% %9s\n",
+            mixings[m], samples/best[m], samples/rate/best[m],
+            100*best[m]/best[0], cardout[m] == cardout[0] ? "exact" : "DIFFERS");
+    }
+    return 0;
+}